@@ -0,0 +1,158 @@
+/* Hashed timing wheel
+ *
+ * An item lives in the slot of its expiry time, a tick only visits the
+ * slot(s) the time went through. Pushing the expiry time back (touch) is
+ * a plain store, the item is moved to its new slot when its old slot is
+ * visited, that is once per timeout at most.
+ *
+ * license: MIT license
+ * Copyright (C) 2021  Edward LEI <edward_lei72@hotmail.com> */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include "xmalloc.h"
+#include "twheel.h"
+
+
+static void _link(twnode_t *head,
+                  twnode_t *node)
+{
+  node->prev = head->prev;
+  node->next = head;
+  head->prev->next = node;
+  head->prev = node;
+}
+
+static void _unlink(twnode_t *node)
+{
+  node->prev->next = node->next;
+  node->next->prev = node->prev;
+  node->prev = node->next = node;
+}
+
+static twnode_t *_slot(twheel_t *tw,
+                       const long expire)
+{
+  /* already due, handled by the next tick */
+  long t = expire < tw->now ? tw->now : expire;
+  return &tw->slots[(t / tw->tick) & (TW_SLOTS - 1)];
+}
+
+twheel_t *twheel_new(const long tick,
+                     tw_del_fn del,
+                     tw_prt_fn prt)
+{
+  twheel_t *tw = xmalloc(sizeof(twheel_t));
+  int i;
+  for (i = 0; i < TW_SLOTS; i++)
+    tw->slots[i].prev = tw->slots[i].next = &tw->slots[i];
+  tw->tick = tick;
+  tw->now = 0;
+  tw->del = del;
+  tw->prt = prt;
+  tw->size = 0;
+  pthread_mutex_init(&tw->mutex, NULL);
+  return tw;
+}
+
+void twheel_delete(twheel_t *tw)
+{
+  int i;
+  for (i = 0; i < TW_SLOTS; i++) {
+    twnode_t *head = &tw->slots[i];
+    while (head->next != head) {
+      twnode_t *node = head->next;
+      _unlink(node);
+      if (tw->del) tw->del(node->data);
+    }
+  }
+  pthread_mutex_destroy(&tw->mutex);
+  xfree(tw);
+}
+
+/* a node not in the wheel points to itself */
+void twheel_node_init(twnode_t *node)
+{
+  node->prev = node->next = node;
+  node->data = NULL;
+  node->expire = 0;
+}
+
+void twheel_add(twheel_t *tw,
+                twnode_t *node,
+                void *data,
+                const long expire)
+{
+  node->data = data;
+  node->expire = expire;
+  _link(_slot(tw, expire), node);
+  tw->size++;
+}
+
+/* return - 1: removed, 0: not in the wheel (e.g. expired) */
+int twheel_remove(twheel_t *tw,
+                  twnode_t *node)
+{
+  if (node->next == node) return 0;
+  _unlink(node);
+  tw->size--;
+  return 1;
+}
+
+/* no lock, no move */
+void twheel_touch(twnode_t *node,
+                  const long expire)
+{
+  node->expire = expire;
+}
+
+void twheel_expire(twheel_t *tw,
+                   const long now)
+{
+  if (tw->now == 0) tw->now = now - now % tw->tick;
+
+  /* a full turn visits every slot, the rest of a long pause
+   * doesn't need to be walked */
+  long end = now - now % tw->tick;
+  if (end - tw->now > TW_SLOTS * tw->tick)
+    tw->now = end - TW_SLOTS * tw->tick;
+
+  while (tw->now <= end) {
+    twnode_t *head = &tw->slots[(tw->now / tw->tick) & (TW_SLOTS - 1)];
+    twnode_t pending;  /* items of the slot, detached */
+    if (head->next == head) {
+      tw->now += tw->tick;
+      continue;
+    }
+    pending.next = head->next;
+    pending.prev = head->prev;
+    pending.next->prev = &pending;
+    pending.prev->next = &pending;
+    head->prev = head->next = head;
+
+    tw->now += tw->tick;
+    while (pending.next != &pending) {
+      twnode_t *node = pending.next;
+      _unlink(node);
+      if (node->expire <= now) {
+        tw->size--;
+        if (tw->del) tw->del(node->data);
+      }
+      else
+        /* touched since, or due in a later turn */
+        _link(_slot(tw, node->expire), node);
+    }
+  }
+}
+
+void twheel_print(twheel_t *tw)
+{
+  int i;
+  for (i = 0; i < TW_SLOTS; i++) {
+    twnode_t *head = &tw->slots[i];
+    twnode_t *node;
+    for (node = head->next; node != head; node = node->next)
+      if (tw->prt) tw->prt(node->data);
+  }
+}
@@ -0,0 +1,60 @@
+/* Hashed timing wheel
+ *
+ * license: MIT license
+ * Copyright (C) 2021  Edward LEI <edward_lei72@hotmail.com> */
+
+#ifndef _TWHEEL_H_
+#define _TWHEEL_H_
+
+
+#define TW_SLOTS 256  /* power of 2 */
+
+typedef void (*tw_del_fn) (void *p);
+typedef void (*tw_prt_fn)(const void *p);
+
+/* the node is embedded in the item, nothing is allocated per timer */
+typedef struct _twnode {
+  struct _twnode *prev;
+  struct _twnode *next;
+  volatile long expire;  /* ms */
+  void *data;
+} twnode_t;
+
+typedef struct {
+  twnode_t slots[TW_SLOTS]; /* list heads */
+  long tick;                /* ms covered by a slot */
+  long now;                 /* start of the current slot, ms */
+  tw_del_fn del;            /* Destroy an expired item (user-defined) */
+  tw_prt_fn prt;            /* Print an item (user-defined) */
+  size_t size;
+
+  pthread_mutex_t mutex;
+} twheel_t;
+
+
+twheel_t *twheel_new(const long tick,
+                     tw_del_fn del,
+                     tw_prt_fn prt);
+
+void twheel_delete(twheel_t *tw);
+
+void twheel_node_init(twnode_t *node);
+
+void twheel_add(twheel_t *tw,
+                twnode_t *node,
+                void *data,
+                const long expire);
+
+int twheel_remove(twheel_t *tw,
+                  twnode_t *node);
+
+void twheel_touch(twnode_t *node,
+                  const long expire);
+
+void twheel_expire(twheel_t *tw,
+                   const long now);
+
+void twheel_print(twheel_t *tw);
+
+
+#endif
@@ -9,11 +9,23 @@
 #include <pthread.h>
 #include <sys/epoll.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <arpa/inet.h>
+#include <linux/filter.h>
 #include <libpq-fe.h>
+#include "util.h"
 #include "rbtree.h"
+#include "twheel.h"
+#include "thpool.h"
 #include "pg_conn.h"
+#include "sllist.h"
+#include "io.h"
+#include "http_header.h"
+#include "http_msg.h"
+#include "http_parser.h"
+#include "http_cache.h"
 #include "http_cfg.h"
+#include "http_method.h"
 #include "http_conn.h"
 #include "epsock.h"
 
@@ -32,50 +44,56 @@ static void _set_nonblocking(const int fd)
     perror("fcntl()");
 }
 
-void epsock_connect(const int srvfd,
-                    const int epfd,
-                    PGconn *pgconn,
-                    rbtree_t *cache,
-                    rbtree_t *timers,
-                    rbtree_t *authdb,
-                    httpcfg_t *cfg)
+int epsock_accept(const int srvfd)
 {
   struct sockaddr cliaddr;
   socklen_t len_cliaddr = sizeof(struct sockaddr);
 
-   /* server socket; accept connections */
   for (;;) {
     int clifd = accept(srvfd, &cliaddr, &len_cliaddr);
 
     if (clifd == -1) {
       if (errno == EINTR) continue;
-      if (errno == EAGAIN || errno == EWOULDBLOCK) {
-        /* we processed all of the connections */
-        break;
-      }
-      perror("accept()");
-      close(clifd);
-      break;
+      /* errno = EAGAIN or EWOULDBLOCK, we processed all of the connections */
+      if (errno != EAGAIN && errno != EWOULDBLOCK) perror("accept()");
+      return -1;
     }
 
     char *cli_ip = inet_ntoa(((struct sockaddr_in *)&cliaddr)->sin_addr);
     D_PRINT("[CONN] client %s connected on socket %d\n", cli_ip, clifd);
 
     _set_nonblocking(clifd);
+    return clifd;
+  }
+}
+
+void epsock_connect(const int srvfd,
+                    const int epfd,
+                    pgpool_t *pgpool,
+                    cache_t *cache,
+                    twheel_t *timers,
+                    thpool_t *iopool,
+                    rbtree_t *authdb,
+                    httpcfg_t *cfg)
+{
+  int clifd;
 
+   /* server socket; accept connections */
+  while ((clifd = epsock_accept(srvfd)) != -1) {
     httpconn_t *cliconn = httpconn_new(clifd, epfd,
-                                       pgconn, cache, timers, authdb,
+                                       pgpool, cache, timers, iopool, authdb,
                                        cfg);
     /* install the new timer */
     pthread_mutex_lock(&timers->mutex);
-    rbtree_insert(timers, cliconn);
+    twheel_add(timers, &cliconn->timer, cliconn,
+               mstime() + SOCKET_KEEPALIVE_TIME);
     pthread_mutex_unlock(&timers->mutex);
 
     if (httpconn_epoll(cliconn, EPOLL_CTL_ADD) == -1) return;
   }
 }
 
-static int _srv_socket()
+static int _srv_socket(const int reuseport)
 {
   int srvfd = socket(AF_INET, SOCK_STREAM, 0);
   if (srvfd == -1) {
@@ -88,10 +106,18 @@ static int _srv_socket()
     perror("setsockopt()");
     return -1;
   }
+  /* every listener in the SO_REUSEPORT group gets its own accept queue,
+   * the kernel load-balances the incoming connections among them */
+  if (reuseport &&
+      setsockopt(srvfd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) == -1) {
+    perror("setsockopt()");
+    return -1;
+  }
   return srvfd;
 }
 
-static int _bind(const uint16_t port)
+static int _bind(const uint16_t port,
+                 const int reuseport)
 {
   struct sockaddr_in srvaddr;
   //memset(&srvaddr, 0, sizeof(struct sockaddr_in));
@@ -99,7 +125,8 @@ static int _bind(const uint16_t port)
   srvaddr.sin_addr.s_addr = htonl(INADDR_ANY);
   srvaddr.sin_port = htons(port);
 
-  int srvfd = _srv_socket();
+  int srvfd = _srv_socket(reuseport);
+  if (srvfd == -1) return -1;
   if (bind(srvfd, (struct sockaddr*)&srvaddr, sizeof(struct sockaddr_in)) < 0) {
     perror("bind()");
     return -1;
@@ -107,15 +134,53 @@ static int _bind(const uint16_t port)
   return srvfd;
 }
 
-int epsock_listen(const uint16_t port)
+static int _listen(const uint16_t port,
+                   const int reuseport)
 {
-  int srvfd = _bind(port);
+  int srvfd = _bind(port, reuseport);
   if (srvfd == -1) exit(1);
   _set_nonblocking(srvfd);
   if (listen(srvfd, SOMAXCONN) < 0) {
     perror("listen()");
     exit(1);
   }
+  return srvfd;
+}
+
+int epsock_listen(const uint16_t port)
+{
+  int srvfd = _listen(port, 0);
   printf("listening on port [%d]\n", port);
   return srvfd;
 }
+
+int epsock_listen_reuseport(const uint16_t port)
+{
+  int srvfd = _listen(port, 1);
+  D_PRINT("[CONN] SO_REUSEPORT listener on socket %d\n", srvfd);
+  return srvfd;
+}
+
+int epsock_steer_cpu(const int srvfd,
+                     const int ngroups)
+{
+  /* A = current cpu; A = A % ngroups; return A
+   * the returned value is the index of the listener in the reuseport group,
+   * i.e. the order in which the listeners were bound */
+  struct sock_filter code[] = {
+    { BPF_LD | BPF_W | BPF_ABS, 0, 0, SKF_AD_OFF + SKF_AD_CPU },
+    { BPF_ALU | BPF_MOD | BPF_K, 0, 0, ngroups },
+    { BPF_RET | BPF_A, 0, 0, 0 }
+  };
+  struct sock_fprog prog = {
+    .len = sizeof(code) / sizeof(code[0]),
+    .filter = code
+  };
+
+  if (setsockopt(srvfd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF,
+                 &prog, sizeof(prog)) == -1) {
+    perror("setsockopt(SO_ATTACH_REUSEPORT_CBPF)");
+    return -1;
+  }
+  return 0;
+}
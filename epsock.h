@@ -5,15 +5,23 @@
 #define _EPSOCK_H_
 
 
+int epsock_accept(const int srvfd);
+
 void epsock_connect(const int srvfd,
                     const int epfd,
-                    PGconn *pgconn,
-                    rbtree_t *cache,
-                    rbtree_t *timers,
+                    pgpool_t *pgpool,
+                    cache_t *cache,
+                    twheel_t *timers,
+                    thpool_t *iopool,
                     rbtree_t *authdb,
                     httpcfg_t *cfg);
 
 int epsock_listen(const uint16_t port);
 
+int epsock_listen_reuseport(const uint16_t port);
+
+int epsock_steer_cpu(const int srvfd,
+                     const int ngroups);
+
 
 #endif
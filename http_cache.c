@@ -4,7 +4,12 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "xmalloc.h"
 #include "util.h"
 #include "rbtree.h"
@@ -14,13 +19,15 @@
 #include "debug.h"
 
 
-#define MAX_CACHE_ITEMS 1024
 #define MAX_CACHE_TIME 86400000    /* 24 x 60 x 60 = 1 day */
 
 
+/* the caller holds the first reference */
 httpcache_t *httpcache_new()
 {
   httpcache_t *data = xmalloc(sizeof(httpcache_t));
+  data->refs = 1;
+  data->mapped = 0;
   return data;
 }
 
@@ -41,6 +48,9 @@ void httpcache_set(httpcache_t *data,
   data->len_body = len_body;
   data->body_zipped = body_zipped;
   data->len_zipped = len_zipped;
+  data->hdr = NULL;
+  data->len_hdr = 0;
+  data->len_hdr_zipped = 0;
 }
 
 void httpcache_clear(void *data)
@@ -50,6 +60,8 @@ void httpcache_clear(void *data)
     if (cd->path) xfree(cd->path);
     if (cd->etag) xfree(cd->etag);
     if (cd->last_modified) xfree(cd->last_modified);
+    if (cd->hdr) xfree(cd->hdr);
+    if (cd->mapped) return;
     if (cd->body) xfree(cd->body);
     if (cd->body_zipped) xfree(cd->body_zipped);
   }
@@ -70,34 +82,486 @@ int httpcache_compare(const void *curr,
   return strcmp(s1, s2);
 }
 
-void httpcache_expire(void *arg)
+void httpcache_release(void *data)
 {
-  rbtree_t *cache = (rbtree_t *)arg;
-  if (cache->size == 0) return;
+  httpcache_t *cd = (httpcache_t *)data;
+  if (__atomic_sub_fetch(&cd->refs, 1, __ATOMIC_ACQ_REL) == 0)
+    httpcache_delete(cd);
+}
 
-  long curr_time = mstime();
-  rbtrav_t *trav = rbtrav_new();
-  void *data = rbtrav_first(trav, cache);
-  httpcache_t *cd;
-
-  do {
-    if (data) {
-      cd = (httpcache_t *)data;
-      if (curr_time - cd->stamp >= MAX_CACHE_TIME) {
-        if (pthread_mutex_trylock(&cache->mutex) == 0) {
-          rbtree_remove(cache, data);
-          pthread_mutex_unlock(&cache->mutex);
-        }
+void httpcache_print(const void *data)
+{
+  httpcache_t *p = (httpcache_t *)data;
+  D_PRINT("[CACHE] path = %s\n", p->path);
+}
+
+/* FNV-1a */
+static unsigned int _hash(const char *path)
+{
+  unsigned int h = 2166136261u;
+  while (*path) {
+    h ^= (unsigned char)*path++;
+    h *= 16777619u;
+  }
+  return h;
+}
+
+static void _fifo_push(cachefifo_t *q,
+                       httpcache_t *cd)
+{
+  cd->fifo = q;
+  cd->prev = NULL;
+  cd->next = q->head;
+  if (q->head) q->head->prev = cd;
+  else q->tail = cd;
+  q->head = cd;
+  q->bytes += cd->size;
+}
+
+static void _fifo_unlink(httpcache_t *cd)
+{
+  cachefifo_t *q = cd->fifo;
+  if (cd->prev) cd->prev->next = cd->next;
+  else q->head = cd->next;
+  if (cd->next) cd->next->prev = cd->prev;
+  else q->tail = cd->prev;
+  q->bytes -= cd->size;
+  cd->fifo = NULL;
+}
+
+/* out of its queue and its tree, its last reader frees it */
+static void _drop(cacheshard_t *shard,
+                  httpcache_t *cd)
+{
+  _fifo_unlink(cd);
+  rbtree_remove(shard->entries, cd);
+}
+
+static int _ghost_take(cacheshard_t *shard,
+                       const unsigned int hash)
+{
+  int i;
+  for (i = 0; i < CACHE_GHOSTS; i++) {
+    if (shard->ghosts[i] == hash) {
+      shard->ghosts[i] = 0;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/* the entries of the small queue used once leave, the main queue gives
+ * each of its entries another round per hit */
+static void _evict(cacheshard_t *shard,
+                   const size_t need)
+{
+  while (shard->small.bytes + shard->main.bytes + need > shard->budget) {
+    httpcache_t *cd;
+    if (shard->small.tail &&
+        (shard->small.bytes > shard->budget / 10 || !shard->main.tail)) {
+      cd = shard->small.tail;
+      _fifo_unlink(cd);
+      if (cd->freq > 0) {
+        cd->freq = 0;
+        _fifo_push(&shard->main, cd);
+        continue;
       }
+      shard->ghosts[shard->ghost] = cd->hash;
+      shard->ghost = (shard->ghost + 1) % CACHE_GHOSTS;
     }
-    data = rbtrav_next(trav);
-  } while (data);
+    else {
+      cd = shard->main.tail;
+      _fifo_unlink(cd);
+      if (cd->freq > 0) {
+        cd->freq--;
+        _fifo_push(&shard->main, cd);
+        continue;
+      }
+    }
+    D_PRINT("[CACHE] <%s> evicted\n", cd->path);
+    rbtree_remove(shard->entries, cd);
+  }
+}
 
-  rbtrav_delete(trav);
+/* size - bytes of the entries at most, shared evenly by the shards */
+cache_t *cache_new(const size_t size)
+{
+  cache_t *cache = xcalloc(1, sizeof(cache_t));
+  int i;
+  for (i = 0; i < CACHE_SHARDS; i++) {
+    pthread_rwlock_init(&cache->shards[i].lock, NULL);
+    pthread_mutex_init(&cache->shards[i].flock, NULL);
+    pthread_cond_init(&cache->shards[i].landed, NULL);
+    /* the tree holds a reference of each entry */
+    cache->shards[i].entries = rbtree_new(httpcache_compare,
+                                          httpcache_release,
+                                          httpcache_print);
+    cache->shards[i].budget = size / CACHE_SHARDS;
+  }
+  return cache;
 }
 
-void httpcache_print(const void *data)
+void cache_delete(cache_t *cache)
 {
-  httpcache_t *p = (httpcache_t *)data;
-  D_PRINT("[CACHE] path = %s\n", p->path);
+  int i;
+  for (i = 0; i < CACHE_SHARDS; i++) {
+    rbtree_delete(cache->shards[i].entries);
+    pthread_rwlock_destroy(&cache->shards[i].lock);
+    pthread_mutex_destroy(&cache->shards[i].flock);
+    pthread_cond_destroy(&cache->shards[i].landed);
+  }
+  /* the entries were the last readers of the mapping */
+  if (cache->snap) munmap(cache->snap, cache->len_snap);
+  xfree(cache);
+}
+
+/* return the entry held for the caller (httpcache_release() it), or NULL */
+httpcache_t *cache_get(cache_t *cache,
+                       const char *path)
+{
+  cacheshard_t *shard = &cache->shards[_hash(path) & (CACHE_SHARDS - 1)];
+  httpcache_t key;
+  key.path = (char *)path;
+
+  pthread_rwlock_rdlock(&shard->lock);
+  httpcache_t *cd = (httpcache_t *)rbtree_search(shard->entries, &key);
+  if (cd) {
+    __atomic_add_fetch(&cd->refs, 1, __ATOMIC_RELAXED);
+    /* racing hits may count as one, it's only a hint */
+    if (cd->freq < CACHE_FREQ_MAX)
+      __atomic_store_n(&cd->freq, cd->freq + 1, __ATOMIC_RELAXED);
+  }
+  pthread_rwlock_unlock(&shard->lock);
+  return cd;
+}
+
+/* taken before the file is looked at, a change dropped since then
+ * keeps its load out of the cache */
+unsigned long cache_gen(cache_t *cache,
+                        const char *path)
+{
+  cacheshard_t *shard = &cache->shards[_hash(path) & (CACHE_SHARDS - 1)];
+  return __atomic_load_n(&shard->gen, __ATOMIC_ACQUIRE);
+}
+
+/* the entry, complete, replaces the one of its path, the caller keeps
+ * its own reference; an entry larger than the budget of its shard, or
+ * read before the last change of its shard (gen), is not cached */
+void cache_put(cache_t *cache,
+               httpcache_t *cd,
+               const unsigned long gen)
+{
+  cd->hash = _hash(cd->path);
+  /* the validators are 30 bytes each */
+  cd->size = sizeof(httpcache_t) + strlen(cd->path) + 1 + 60 +
+             cd->len_body + cd->len_zipped + cd->len_hdr_zipped;
+  cd->freq = 0;
+  cacheshard_t *shard = &cache->shards[cd->hash & (CACHE_SHARDS - 1)];
+  cachefifo_t *q = &shard->small;
+
+  pthread_rwlock_wrlock(&shard->lock);
+  if (shard->gen != gen) {
+    pthread_rwlock_unlock(&shard->lock);
+    D_PRINT("[CACHE] <%s> changed while loaded\n", cd->path);
+    return;
+  }
+  httpcache_t *old = (httpcache_t *)rbtree_search(shard->entries, cd);
+  if (old) {
+    /* a reload stays where the file was */
+    q = old->fifo;
+    cd->freq = old->freq;
+    _drop(shard, old);
+  }
+  else if (_ghost_take(shard, cd->hash))
+    q = &shard->main;
+
+  if (cd->size <= shard->budget) {
+    _evict(shard, cd->size);
+    __atomic_add_fetch(&cd->refs, 1, __ATOMIC_RELAXED);
+    rbtree_insert(shard->entries, cd);
+    _fifo_push(q, cd);
+  }
+  pthread_rwlock_unlock(&shard->lock);
+}
+
+/* a miss of the path (etag - of the file it found), return the flight
+ * to load it on, cache_land() it after its cache_put(); NULL if another
+ * load of the same file just landed, or was under way, cd then holds its
+ * entry */
+cacheflight_t *cache_flight(cache_t *cache,
+                            const char *path,
+                            const char *etag,
+                            httpcache_t **cd)
+{
+  unsigned int hash = _hash(path);
+  cacheshard_t *shard = &cache->shards[hash & (CACHE_SHARDS - 1)];
+  cacheflight_t *f;
+
+  pthread_mutex_lock(&shard->flock);
+  for (;;) {
+    for (f = shard->flights; f; f = f->next) {
+      if (f->hash == hash && strcmp(f->path, path) == 0) break;
+    }
+    if (!f) break;
+
+    f->waiters++;
+    while (!f->landed) pthread_cond_wait(&shard->landed, &shard->flock);
+    *cd = f->cd;
+    if (--f->waiters == 0) xfree(f);
+    if (*cd && strcmp((*cd)->etag, etag) == 0) {
+      pthread_mutex_unlock(&shard->flock);
+      return NULL;
+    }
+    /* failed, or read before the file the miss found was in place */
+    if (*cd) httpcache_release(*cd);
+  }
+
+  /* put in the cache since the miss */
+  *cd = cache_get(cache, path);
+  if (*cd && strcmp((*cd)->etag, etag) == 0) {
+    pthread_mutex_unlock(&shard->flock);
+    return NULL;
+  }
+  if (*cd) {
+    httpcache_release(*cd);
+    *cd = NULL;
+  }
+
+  f = xmalloc(sizeof(cacheflight_t));
+  f->path = path;
+  f->hash = hash;
+  f->landed = 0;
+  f->waiters = 0;
+  f->cd = NULL;
+  f->next = shard->flights;
+  shard->flights = f;
+  pthread_mutex_unlock(&shard->flock);
+  return f;
+}
+
+/* the load of the flight is done (cd, NULL if it failed), its waiters
+ * are given the entry */
+void cache_land(cache_t *cache,
+                cacheflight_t *f,
+                httpcache_t *cd)
+{
+  cacheshard_t *shard = &cache->shards[f->hash & (CACHE_SHARDS - 1)];
+  cacheflight_t **p;
+
+  pthread_mutex_lock(&shard->flock);
+  for (p = &shard->flights; *p != f; p = &(*p)->next);
+  *p = f->next;
+
+  if (f->waiters == 0) {
+    xfree(f);
+    pthread_mutex_unlock(&shard->flock);
+    return;
+  }
+  D_PRINT("[CACHE] <%s> loaded for %d more\n", f->path, f->waiters);
+  if (cd) __atomic_add_fetch(&cd->refs, f->waiters, __ATOMIC_RELAXED);
+  f->cd = cd;
+  f->landed = 1;
+  pthread_cond_broadcast(&shard->landed);
+  pthread_mutex_unlock(&shard->flock);
+}
+
+/* the file of the path changed, its entry (if any) goes */
+void cache_drop(cache_t *cache,
+                const char *path)
+{
+  cacheshard_t *shard = &cache->shards[_hash(path) & (CACHE_SHARDS - 1)];
+  httpcache_t key;
+  key.path = (char *)path;
+
+  pthread_rwlock_wrlock(&shard->lock);
+  __atomic_add_fetch(&shard->gen, 1, __ATOMIC_RELEASE);
+  httpcache_t *cd = (httpcache_t *)rbtree_search(shard->entries, &key);
+  if (cd) {
+    D_PRINT("[CACHE] <%s> dropped\n", cd->path);
+    _drop(shard, cd);
+  }
+  pthread_rwlock_unlock(&shard->lock);
+}
+
+/* a directory moved or went, "" drops everything */
+void cache_drop_prefix(cache_t *cache,
+                       const char *prefix)
+{
+  size_t len = strlen(prefix);
+  int i;
+
+  for (i = 0; i < CACHE_SHARDS; i++) {
+    cacheshard_t *shard = &cache->shards[i];
+    pthread_rwlock_wrlock(&shard->lock);
+    __atomic_add_fetch(&shard->gen, 1, __ATOMIC_RELEASE);
+    if (shard->entries->size == 0) {
+      pthread_rwlock_unlock(&shard->lock);
+      continue;
+    }
+
+    httpcache_t **dropped = xmalloc(shard->entries->size *
+                                    sizeof(httpcache_t *));
+    size_t n = 0;
+    rbtrav_t *trav = rbtrav_new();
+    httpcache_t *cd = (httpcache_t *)rbtrav_first(trav, shard->entries);
+    while (cd) {
+      if (strncmp(cd->path, prefix, len) == 0) dropped[n++] = cd;
+      cd = (httpcache_t *)rbtrav_next(trav);
+    }
+    rbtrav_delete(trav);
+
+    while (n > 0) _drop(shard, dropped[--n]);
+    pthread_rwlock_unlock(&shard->lock);
+    xfree(dropped);
+  }
+}
+
+/* the entries are collected first, the tree is not changed under its
+ * traversal; a busy shard waits for the next round */
+void cache_expire(void *arg)
+{
+  cache_t *cache = (cache_t *)arg;
+  long curr_time = mstime();
+  int i;
+
+  for (i = 0; i < CACHE_SHARDS; i++) {
+    cacheshard_t *shard = &cache->shards[i];
+    if (shard->entries->size == 0) continue;
+    if (pthread_rwlock_trywrlock(&shard->lock) != 0) continue;
+
+    httpcache_t **expired = xmalloc(shard->entries->size *
+                                    sizeof(httpcache_t *));
+    size_t n = 0;
+    rbtrav_t *trav = rbtrav_new();
+    httpcache_t *cd = (httpcache_t *)rbtrav_first(trav, shard->entries);
+    while (cd) {
+      if (curr_time - cd->stamp >= MAX_CACHE_TIME) expired[n++] = cd;
+      cd = (httpcache_t *)rbtrav_next(trav);
+    }
+    rbtrav_delete(trav);
+
+    while (n > 0) _drop(shard, expired[--n]);
+    pthread_rwlock_unlock(&shard->lock);
+    xfree(expired);
+  }
+}
+
+/* the cached files with their validators, written at the exit for the
+ * next start; a new file takes the place of the old one, which may still
+ * be mapped; return -1 if it couldn't be written */
+int cache_save(cache_t *cache,
+               const char *file)
+{
+  char tmp[PATH_MAX];
+  snprintf(tmp, PATH_MAX, "%s.tmp", file);
+  FILE *f = fopen(tmp, "w");
+  if (!f) {
+    perror("[CACHE] fopen()");
+    return -1;
+  }
+
+  fwrite(CACHE_SNAP_MAGIC, 1, 16, f);
+  long n = 0;
+  int i;
+  for (i = 0; i < CACHE_SHARDS; i++) {
+    cacheshard_t *shard = &cache->shards[i];
+    pthread_rwlock_rdlock(&shard->lock);
+    rbtrav_t *trav = rbtrav_new();
+    httpcache_t *cd = (httpcache_t *)rbtrav_first(trav, shard->entries);
+    while (cd) {
+      cachesnap_t rec;
+      rec.len_path = strlen(cd->path) + 1;
+      rec.len_etag = strlen(cd->etag) + 1;
+      rec.len_modified = strlen(cd->last_modified) + 1;
+      rec.pad = 0;
+      rec.len_body = cd->len_body;
+      rec.len_zipped = cd->body_zipped ? cd->len_zipped : 0;
+      fwrite(&rec, sizeof(cachesnap_t), 1, f);
+      fwrite(cd->path, 1, rec.len_path, f);
+      fwrite(cd->etag, 1, rec.len_etag, f);
+      fwrite(cd->last_modified, 1, rec.len_modified, f);
+      fwrite(cd->body, 1, rec.len_body, f);
+      if (rec.len_zipped) fwrite(cd->body_zipped, 1, rec.len_zipped, f);
+      n++;
+      cd = (httpcache_t *)rbtrav_next(trav);
+    }
+    rbtrav_delete(trav);
+    pthread_rwlock_unlock(&shard->lock);
+  }
+
+  if (fclose(f) != 0 || rename(tmp, file) == -1) {
+    perror("[CACHE] snapshot");
+    unlink(tmp);
+    return -1;
+  }
+  D_PRINT("[CACHE] %ld files saved to %s\n", n, file);
+  return 0;
+}
+
+/* the snapshot is mapped for the life of the cache, add() is given each
+ * record to validate and to cache, 1 if it did; return the records
+ * cached, -1 if there is no snapshot */
+int cache_load(cache_t *cache,
+               const char *file,
+               int (*add)(cache_t *cache, const cacherec_t *rec, void *arg),
+               void *arg)
+{
+  int fd = open(file, O_RDONLY);
+  if (fd == -1) return -1;
+
+  struct stat sb;
+  if (fstat(fd, &sb) == -1 || (size_t)sb.st_size < 16) {
+    close(fd);
+    return -1;
+  }
+  size_t len = sb.st_size;
+  char *map = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) return -1;
+  if (memcmp(map, CACHE_SNAP_MAGIC, 16) != 0) {
+    munmap(map, len);
+    return -1;
+  }
+  cache->snap = map;
+  cache->len_snap = len;
+
+  int n = 0;
+  size_t off = 16;
+  while (off + sizeof(cachesnap_t) <= len) {
+    cachesnap_t rec;
+    memcpy(&rec, map + off, sizeof(cachesnap_t));
+    off += sizeof(cachesnap_t);
+    size_t size = (size_t)rec.len_path + rec.len_etag + rec.len_modified +
+                  rec.len_body + rec.len_zipped;
+    /* truncated, or not a record */
+    if (size > len - off || !rec.len_path || !rec.len_etag ||
+        !rec.len_modified) break;
+
+    cacherec_t r;
+    r.path = map + off;
+    r.etag = r.path + rec.len_path;
+    r.last_modified = r.etag + rec.len_etag;
+    r.body = (unsigned char *)r.last_modified + rec.len_modified;
+    r.len_body = rec.len_body;
+    r.body_zipped = rec.len_zipped ? r.body + rec.len_body : NULL;
+    r.len_zipped = rec.len_zipped;
+    off += size;
+    if (r.path[rec.len_path - 1] || r.etag[rec.len_etag - 1] ||
+        r.last_modified[rec.len_modified - 1]) break;
+
+    n += add(cache, &r, arg);
+  }
+  return n;
+}
+
+void cache_print(cache_t *cache)
+{
+  int i;
+  for (i = 0; i < CACHE_SHARDS; i++) {
+    cacheshard_t *shard = &cache->shards[i];
+    D_PRINT("[CACHE] shard %d: %zu bytes, small %zu, main %zu\n", i,
+            shard->small.bytes + shard->main.bytes, shard->small.bytes,
+            shard->main.bytes);
+    rbtree_print(shard->entries);
+  }
 }
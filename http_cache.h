@@ -5,18 +5,110 @@
 #define _HTTP_CACHE_H_
 
 
+#define CACHE_SHARDS 16  /* power of 2 */
+#define CACHE_GHOSTS 256 /* paths a shard remembers after their eviction */
+#define CACHE_FREQ_MAX 3
+#define CACHE_SNAP_MAGIC "MAESTRO-CACHE-1\n"  /* 16 bytes */
+
+
 typedef struct {
+  struct httpcache_s *head; /* newest */
+  struct httpcache_s *tail; /* evicted first */
+  size_t bytes;
+} cachefifo_t;
+
+/* the content of an entry is never changed once it is in the cache,
+ * a reload puts a new one in its place, the replies being built from the
+ * old one hold it until they are sent; the shard's write lock guards the
+ * queue links */
+typedef struct httpcache_s {
   char *path;
   char *etag;
   char *last_modified;
-  long stamp;
+  volatile long stamp;      /* loaded or revalidated */
+  int refs;                 /* the cache's and the readers' */
+
+  unsigned int hash;        /* of the path */
+  size_t size;              /* bytes charged to the cache */
+  int freq;                 /* hits since it was queued, capped */
+  cachefifo_t *fifo;        /* the queue it is in */
+  struct httpcache_s *prev; /* newer */
+  struct httpcache_s *next; /* older */
 
   unsigned char *body;
   unsigned char *body_zipped;
   size_t len_body;
   size_t len_zipped;
+  int mapped;               /* the bodies are in the snapshot's mapping */
+
+  /* headers rendered once per load, the Content-Encoding and Vary lines
+   * of the compressed reply go last, after the first len_hdr bytes */
+  char *hdr;
+  size_t len_hdr;
+  size_t len_hdr_zipped;
 } httpcache_t;
 
+/* a file being read into the cache, the other misses of its path wait
+ * for it to land instead of reading it too */
+typedef struct cacheflight_s {
+  const char *path;         /* the loader's */
+  unsigned int hash;
+  int landed;
+  int waiters;              /* the last one out frees the flight */
+  httpcache_t *cd;          /* loaded, held for each waiter; NULL if gone */
+  struct cacheflight_s *next;
+} cacheflight_t;
+
+/* the lock of a shard is only held to look an entry up or to swap it,
+ * the shard keeps its bytes under its budget (S3-FIFO): a new entry goes
+ * into the small queue, out of it only the ones hit again go on to the
+ * main queue, the others leave their path in the ghosts, a path coming
+ * back from the ghosts goes straight into the main queue */
+typedef struct {
+  pthread_rwlock_t lock;
+  rbtree_t *entries;        /* httpcache_t, by path */
+  size_t budget;
+  cachefifo_t small;        /* a tenth of the budget */
+  cachefifo_t main;
+  unsigned int ghosts[CACHE_GHOSTS];  /* hashes of the paths, a ring */
+  int ghost;                /* the next one to overwrite */
+  unsigned long gen;        /* bumped by every drop of a changed file */
+  pthread_mutex_t flock;    /* taken before the lock */
+  pthread_cond_t landed;
+  cacheflight_t *flights;
+} cacheshard_t;
+
+/* the files cached in memory, a path hashes to its shard */
+typedef struct {
+  cacheshard_t shards[CACHE_SHARDS];
+  volatile int watched;     /* every directory of the docroot is watched,
+                             * a hit is served without a stat() */
+  void *snap;               /* the snapshot mapped at the start */
+  size_t len_snap;
+} cache_t;
+
+/* a record of the snapshot, followed by the path, the etag and the
+ * last_modified (terminated), the body and the compressed body */
+typedef struct {
+  unsigned int len_path;
+  unsigned int len_etag;
+  unsigned int len_modified;
+  unsigned int pad;
+  unsigned long len_body;
+  unsigned long len_zipped;
+} cachesnap_t;
+
+/* a record read back, the strings and the bodies in the mapping */
+typedef struct {
+  const char *path;
+  const char *etag;
+  const char *last_modified;
+  unsigned char *body;
+  size_t len_body;
+  unsigned char *body_zipped;
+  size_t len_zipped;
+} cacherec_t;
+
 
 httpcache_t *httpcache_new();
 
@@ -33,12 +125,53 @@ void httpcache_clear(void *data);
 
 void httpcache_delete(void *data);
 
+void httpcache_release(void *data);
+
 int httpcache_compare(const void *curr,
                       const void *cache);
 
-void httpcache_expire(void *arg);
-
 void httpcache_print(const void *data);
 
+cache_t *cache_new(const size_t size);
+
+void cache_delete(cache_t *cache);
+
+httpcache_t *cache_get(cache_t *cache,
+                       const char *path);
+
+unsigned long cache_gen(cache_t *cache,
+                        const char *path);
+
+void cache_put(cache_t *cache,
+               httpcache_t *cd,
+               const unsigned long gen);
+
+cacheflight_t *cache_flight(cache_t *cache,
+                            const char *path,
+                            const char *etag,
+                            httpcache_t **cd);
+
+void cache_land(cache_t *cache,
+                cacheflight_t *f,
+                httpcache_t *cd);
+
+void cache_drop(cache_t *cache,
+                const char *path);
+
+void cache_drop_prefix(cache_t *cache,
+                       const char *prefix);
+
+void cache_expire(void *arg);
+
+int cache_save(cache_t *cache,
+               const char *file);
+
+int cache_load(cache_t *cache,
+               const char *file,
+               int (*add)(cache_t *cache, const cacherec_t *rec, void *arg),
+               void *arg);
+
+void cache_print(cache_t *cache);
+
 
 #endif
@@ -2,22 +2,44 @@
  * Copyright (C) 2021  Edward LEI <edward_lei72@hotmail.com> */
 
 #include <stdio.h>
+#include <limits.h>
+#include <unistd.h>
 #include "xmalloc.h"
 #include "http_cfg.h"
 
 
 #define CACHE_MAX_AGE 300000 /* ms */
+#define MAX_BODY_SIZE 67108864 /* 64MB */
+#define SENDFILE_SIZE 1048576 /* 1MB */
+#define CACHE_SIZE 67108864 /* 64MB */
+#define IO_THREADS 4
+#define PG_CONNS 8
 
 
 httpcfg_t *httpcfg_new()
 {
   httpcfg_t *c = xmalloc(sizeof(httpcfg_t));
+  char cwd[PATH_MAX];
+  c->docroot = xstrdup(getcwd(cwd, PATH_MAX) ? cwd : ".");
+  c->warm_dir = NULL;
+  c->snapshot = NULL;
   c->max_age = CACHE_MAX_AGE;
   c->jwt_exp = 86400;  /* 86400 = 24 hrs */
+  c->max_body = MAX_BODY_SIZE;
+  c->sendfile_size = SENDFILE_SIZE;
+  c->cache_size = CACHE_SIZE;
+  c->io_threads = IO_THREADS;
+  c->pg_conns = PG_CONNS;
+  c->reactors = 0;
+  c->reuseport = 0;
+  c->steer_cpu = 0;
   return c;
 }
 
 void httpcfg_delete(httpcfg_t *c)
 {
+  xfree(c->docroot);
+  if (c->warm_dir) xfree(c->warm_dir);
+  if (c->snapshot) xfree(c->snapshot);
   xfree(c);
 }
@@ -6,8 +6,19 @@
 
 
 typedef struct {
+  char *docroot;  /* the files served, the working directory */
+  char *warm_dir;  /* request path of the files cached at the start */
+  char *snapshot;  /* the cache saved at the exit, mapped at the start */
   long max_age;
   long jwt_exp;
+  size_t max_body;  /* largest request body accepted */
+  size_t sendfile_size;  /* larger files are sent with sendfile(), uncached */
+  size_t cache_size;  /* bytes of the cached files at most */
+  int io_threads; /* initial size of the pool for blocking work */
+  int pg_conns;   /* postgresql connections at most */
+  int reactors;  /* 0 = one dispatcher + thread pool, n = n epoll reactors */
+  int reuseport; /* one SO_REUSEPORT listener per reactor */
+  int steer_cpu; /* accept on the reactor pinned to the receiving cpu */
 } httpcfg_t;
 
 
@@ -8,14 +8,20 @@
 #include <pthread.h>
 #include <sys/epoll.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <libpq-fe.h>
 #include "xmalloc.h"
 #include "util.h"
 #include "io.h"
 #include "sllist.h"
 #include "rbtree.h"
+#include "pg_conn.h"
+#include "twheel.h"
+#include "thpool.h"
+#include "http_header.h"
 #include "http_msg.h"
 #include "http_parser.h"
+#include "http_cache.h"
 #include "http_cfg.h"
 #include "http_method.h"
 #include "http_conn.h"
@@ -24,40 +30,97 @@
 #include "debug.h"
 
 
-#define SOCKET_KEEPALIVE_TIME 60000  /* 60 seconds */
+#define RBUF_KEEP_SIZE 16384         /* larger idle buffers are released */
 
 
+/* a connection is referenced by the timer wheel while it is alive and by
+ * each event being served, the last reference closes the socket */
 httpconn_t *httpconn_new(const int sockfd,
                          const int epfd,
-                         PGconn *pgconn,
-                         rbtree_t *cache,
-                         rbtree_t *timers,
+                         pgpool_t *pgpool,
+                         cache_t *cache,
+                         twheel_t *timers,
+                         thpool_t *iopool,
                          rbtree_t *authdb,
                          httpcfg_t *cfg)
 {
   httpconn_t *conn = xmalloc(sizeof(httpconn_t));
   conn->sockfd = sockfd;
   conn->epfd = epfd;
-  conn->stamp = mstime();
-  conn->pgconn = pgconn;
+  conn->refs = 1;
+  conn->closing = 0;
+  twheel_node_init(&conn->timer);
+  conn->rbuf = NULL;
+  conn->rbuf_size = 0;
+  conn->rbuf_len = 0;
+  http_parser_init(&conn->parser, cfg ? cfg->max_body : 0);
+  ioqueue_init(&conn->wq, sockfd);
+  conn->job.routine = NULL;
+  conn->job.poll = NULL;
+  conn->job.events = 0;
+  conn->pending = NULL;
+  conn->resume = 0;
+  conn->pgpool = pgpool;
   conn->cache = cache;
   conn->timers = timers;
+  conn->iopool = iopool;
   conn->authdb = authdb;
   conn->cfg = cfg;
   return conn;
 }
 
-void httpconn_delete(void *conn)
+static void _delete(httpconn_t *conn)
 {
-  if (conn) {
-    httpconn_t *c = (httpconn_t *)conn;
-    D_PRINT("[CONN] server disconnected from socket %d\n", c->sockfd);
-    /* explicitly remove the event from epoll */
-    httpconn_epoll(conn, EPOLL_CTL_DEL);
-    shutdown(c->sockfd, SHUT_RDWR);
-    close(c->sockfd);
-    xfree(c);
-  }
+  D_PRINT("[CONN] server disconnected from socket %d\n", conn->sockfd);
+  /* closing the socket also removes it from epoll */
+  shutdown(conn->sockfd, SHUT_RDWR);
+  close(conn->sockfd);
+  /* parked, no client to take its replies anymore */
+  if (conn->job.poll) conn->job.abort(conn->job.arg);
+  if (conn->pending) msg_delete(conn->pending, 0);
+  http_parser_reset(&conn->parser);
+  ioqueue_clear(&conn->wq);
+  if (conn->rbuf) xfree(conn->rbuf);
+  xfree(conn);
+}
+
+void httpconn_hold(httpconn_t *conn)
+{
+  __atomic_add_fetch(&conn->refs, 1, __ATOMIC_RELAXED);
+}
+
+void httpconn_release(httpconn_t *conn)
+{
+  if (__atomic_sub_fetch(&conn->refs, 1, __ATOMIC_ACQ_REL) == 0)
+    _delete(conn);
+}
+
+/* no more events, a served event which re-arms the socket gets ENOENT */
+static void _stop(httpconn_t *conn)
+{
+  conn->closing = 1;
+  epoll_ctl(conn->epfd, EPOLL_CTL_DEL, conn->sockfd, NULL);
+}
+
+/* closed by the client or broken, released right away, not at the timeout */
+void httpconn_close(httpconn_t *conn)
+{
+  pthread_mutex_lock(&conn->timers->mutex);
+  int removed = twheel_remove(conn->timers, &conn->timer);
+  pthread_mutex_unlock(&conn->timers->mutex);
+
+  _stop(conn);
+  /* the timer wheel drops its reference, unless it has just expired */
+  if (removed) httpconn_release(conn);
+}
+
+/* called by the timer wheel (with its lock held) when the keep-alive
+ * timeout is reached, an event being served keeps the connection */
+void httpconn_timeout(void *conn)
+{
+  httpconn_t *c = (httpconn_t *)conn;
+  _stop(c);
+  httpconn_release(c);
 }
 
 int httpconn_epoll(httpconn_t *conn,
@@ -66,91 +129,247 @@ int httpconn_epoll(httpconn_t *conn,
   struct epoll_event event;
   event.data.ptr = (void *)conn;
   /* With the use of EPOLLONESHOT, it is guaranteed that a client
-   * file descriptor is only used by one thread at a time */
-  event.events = EPOLLIN | EPOLLET | EPOLLONESHOT;
+   * file descriptor is only used by one thread at a time,
+   * while replies are waiting only the writability is watched,
+   * a writable socket also brings a connection back from the I/O pool */
+  event.events = conn->wq.head || conn->resume ? EPOLLOUT : EPOLLIN;
+  event.events |= EPOLLET | EPOLLONESHOT;
   int rc = epoll_ctl(conn->epfd, op, conn->sockfd, &event);
   if (rc == -1) perror("[CONN] epoll_ctl");
   return rc;
 }
 
-int httpconn_compare(const void *curr,
-                     const void *conn)
+/* drop the bytes of the request just served, keep the pipelined rest */
+static void _consume(httpconn_t *conn,
+                     const size_t len)
 {
-  httpconn_t *p1 = (httpconn_t *)curr;
-  httpconn_t *p2 = (httpconn_t *)conn;
-  return p1->sockfd - p2->sockfd;
+  conn->rbuf_len -= len;
+  if (conn->rbuf_len)
+    memmove(conn->rbuf, conn->rbuf + len, conn->rbuf_len);
+  else if (conn->rbuf_size > RBUF_KEEP_SIZE) {
+    xfree(conn->rbuf);
+    conn->rbuf = NULL;
+    conn->rbuf_size = 0;
+  }
 }
 
-void httpconn_task(void *arg)
+/* the events of the job's socket bring the connection back to _serve(),
+ * the client socket isn't armed meanwhile */
+static void _job_watch(httpconn_t *conn,
+                       const int events)
+{
+  struct epoll_event event;
+  event.data.ptr = (void *)conn;
+  event.events = events | EPOLLONESHOT;
+  if (epoll_ctl(conn->epfd, EPOLL_CTL_ADD, conn->job.fd, &event) == -1)
+    perror("[CONN] epoll_ctl");
+}
+
+/* run the poll job until it waits;
+ * return - 2: waiting for its socket, the job holds a reference,
+ *          1: parked until the client takes the replies (EPOLLOUT),
+ *          0: done, -1: the reply is cut, close the connection */
+static int _job_step(httpconn_t *conn)
+{
+  int events = conn->job.poll(&conn->wq, conn->job.arg);
+  if (events <= 0) {
+    conn->job.poll = NULL;
+    return events;
+  }
+  /* the client doesn't keep up, nothing more is produced for it */
+  if (conn->wq.head) {
+    conn->job.events = 0;
+    return 1;
+  }
+  conn->job.events = events;
+  httpconn_hold(conn);
+  _job_watch(conn, events);
+  return 2;
+}
+
+static void _job_abort(httpconn_t *conn)
+{
+  conn->job.abort(conn->job.arg);
+  conn->job.poll = NULL;
+}
+
+/* on the I/O pool, the connection is armed again once the reply is sent
+ * (or the poll job left by the routine is parked), the next event serves
+ * what was pipelined behind the request */
+static void _job_cb(void *arg)
 {
   httpconn_t *conn = (httpconn_t *)arg;
+  conn->job.routine(&conn->wq, conn->job.arg);
+  conn->job.routine = NULL;
+
+  int rc = 0;
+  if (conn->job.poll) {
+    if (conn->closing)
+      _job_abort(conn);
+    else
+      rc = _job_step(conn);
+  }
+  if (rc == -1)
+    httpconn_close(conn);
+  else if (rc != 2) {
+    if (rc == 0) __atomic_store_n(&conn->resume, 1, __ATOMIC_RELEASE);
+    if (!conn->closing) httpconn_epoll(conn, EPOLL_CTL_MOD);
+  }
+  httpconn_release(conn);
+}
+
+/* return - 2: waiting for a job, 1: keep the connection, 0: close it */
+static int _serve(httpconn_t *conn)
+{
+  httpparser_t *p = &conn->parser;
   int rc;
-  unsigned char *bytes = io_socket_read(conn->sockfd, &rc);
+
+  if (conn->job.poll) {
+    if (conn->job.events) {
+      /* the job's socket is ready; it leaves the epoll set at each event,
+       * its owner may hand it over as soon as the job is done */
+      epoll_ctl(conn->epfd, EPOLL_CTL_DEL, conn->job.fd, NULL);
+      /* the job's reference, the event holds another one */
+      httpconn_release(conn);
+    }
+    else {
+      /* parked, the client takes the replies of the job first */
+      rc = ioqueue_flush(&conn->wq);
+      if (rc == -1) return 0;
+      if (rc == 0) return 1;
+    }
+    twheel_touch(&conn->timer, mstime() + SOCKET_KEEPALIVE_TIME);
+
+    if (conn->closing) {
+      _job_abort(conn);
+      return 1;
+    }
+    rc = _job_step(conn);
+    if (rc == -1) return 0;
+    if (rc) return rc;
+    conn->resume = 1;
+  }
+
+  /* the job is done, so is the request */
+  if (conn->resume) {
+    conn->resume = 0;
+    msg_delete(conn->pending, 0);
+    conn->pending = NULL;
+    _consume(conn, p->len_head + p->len_body);
+    http_parser_reset(p);
+  }
+
+  /* the socket is writable again, the waiting replies go first */
+  if (conn->wq.head) {
+    rc = ioqueue_flush(&conn->wq);
+    if (rc == -1) return 0;
+    twheel_touch(&conn->timer, mstime() + SOCKET_KEEPALIVE_TIME);
+    /* still full, no new request is served before the queue drains */
+    if (rc == 0) return 1;
+  }
+
+  /* once the headers are parsed, the buffer is sized for the whole body */
+  size_t want = p->state == PARSER_BODY ? p->len_head + p->len_body : 0;
+  unsigned char *rbuf = conn->rbuf;
+  size_t len = conn->rbuf_len;
+  rc = io_socket_read(conn->sockfd, &conn->rbuf, &conn->rbuf_size,
+                      &conn->rbuf_len, want);
+  /* the request parsed so far points into the buffer */
+  if (rbuf != conn->rbuf) http_parser_rebase(p, rbuf, conn->rbuf, len);
 
   /* rc = 0:  the client has closed the connection */
   if (rc == 0) {
     //D_PRINT("[CONN] client disconnected: %d\n", conn->sockfd);
-    return;
+    return 0;
   }
+  if (rc == -1) return 0;
 
-  if (rc == 1) {
-    D_PRINT("[CONN] raw bytes:\n%s\n", bytes);
-    if (bytes == NULL) return;
+  D_PRINT("[CONN] raw bytes:\n%.*s\n", (int)conn->rbuf_len, conn->rbuf);
+  /* the buffer may hold several pipelined requests */
+  for (;;) {
+    rc = http_parse_req(p, conn->rbuf, conn->rbuf_len);
+    /* incomplete, resume on the next EPOLLIN */
+    if (rc == PARSER_AGAIN) break;
 
-    httpmsg_t *req = http_parse_req(bytes);
-    if (req == NULL) return;
+    if (rc == PARSER_ERROR) {
+      D_PRINT("[CONN] not a valid message\n");
+      return 0;
+    }
+
+    httpmsg_t *req = p->msg;
+    p->msg = NULL;
+    /* a method leaves the blocking work here, if there is a pool for it */
+    httpjob_t *job = conn->iopool ? &conn->job : NULL;
 
     /* static GET */
     if (req->method == METHOD_GET || req->method == METHOD_HEAD) {
-      http_get(conn->sockfd, conn->cache, req->path, conn->cfg, req);
+      http_get(&conn->wq, conn->cache, req->path, conn->cfg, req, job);
     }
 
     /* POST */
     if (req->method == METHOD_POST) {
-      http_post(conn->sockfd, conn->pgconn, conn->authdb, conn->cfg, req);
+      http_post(&conn->wq, conn->pgpool, conn->authdb, conn->cfg, req, job);
+    }
+
+    if (conn->job.routine || conn->job.poll) {
+      /* the request and its bytes stay until the job is done */
+      conn->pending = req;
+      twheel_touch(&conn->timer, mstime() + SOCKET_KEEPALIVE_TIME);
+      if (conn->job.routine) {
+        httpconn_hold(conn);
+        thpool_add_task(conn->iopool, _job_cb, conn);
+        return 2;
+      }
+      /* as far as it goes now, the rest is left to the events */
+      rc = _job_step(conn);
+      if (rc == -1) return 0;
+      if (rc) return rc;
+      conn->pending = NULL;
     }
 
-    /* update timestamp for http-keepalive */
-    conn->stamp = mstime();
+    msg_delete(req, 0);
+    _consume(conn, p->len_head + p->len_body);
+    http_parser_reset(p);
+
+    /* the client doesn't keep up, the pipelined rest waits for EPOLLOUT */
+    if (conn->wq.head) break;
+  }
+
+  /* push the keep-alive timeout back, the wheel moves the timer lazily */
+  twheel_touch(&conn->timer, mstime() + SOCKET_KEEPALIVE_TIME);
+  return 1;
+}
+
+/* serves one event, the dispatcher took a reference (httpconn_hold)
+ * for it before handing the connection over */
+void httpconn_task(void *arg)
+{
+  httpconn_t *conn = (httpconn_t *)arg;
 
-    msg_delete(req, 1);
-    xfree(bytes);
+  int rc = _serve(conn);
+  if (rc == 0)
+    httpconn_close(conn);
+  else if (rc == 1 && !conn->closing)
     /* put the event back */
     httpconn_epoll(conn, EPOLL_CTL_MOD);
-    return;
-  }
+
+  httpconn_release(conn);
 }
 
+/* only the slots the time went through are visited, it runs on the thread
+ * waiting on the epoll set, after the events got their references */
 void httpconn_expire(void *arg)
 {
-  rbtree_t *timers = (rbtree_t *)arg;
-  if (timers->size == 0) return;
-
-  long curr_time = mstime();
-  rbtrav_t *trav = rbtrav_new();
-  void *data = rbtrav_first(trav, timers);
-  httpconn_t *conn;
-
-  do {
-    if (data) {
-      conn = (httpconn_t *)data;
-      if (curr_time - conn->stamp > SOCKET_KEEPALIVE_TIME) {
-        if (pthread_mutex_trylock(&timers->mutex) == 0) {
-          /* remove the expired timer */
-          rbtree_remove(timers, data);
-          pthread_mutex_unlock(&timers->mutex);
-        }
-      }
-    }
-    data = rbtrav_next(trav);
-  } while (data);
+  twheel_t *timers = (twheel_t *)arg;
 
-  rbtrav_delete(trav);
-  D_PRINT("[RBTREE] size = %ld\n", timers->size);
+  pthread_mutex_lock(&timers->mutex);
+  twheel_expire(timers, mstime());
+  pthread_mutex_unlock(&timers->mutex);
+  D_PRINT("[TIMER] size = %ld\n", timers->size);
 }
 
 void httpconn_print(const void *data)
 {
   httpconn_t *p = (httpconn_t *)data;
-  D_PRINT("[CONN] sockfd = %d, stamp = %ld\n", p->sockfd, p->stamp);
+  D_PRINT("[CONN] sockfd = %d, expire = %ld\n", p->sockfd, p->timer.expire);
 }
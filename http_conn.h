@@ -5,14 +5,32 @@
 #define _HTTPCONN_H_
 
 
+#define SOCKET_KEEPALIVE_TIME 60000  /* 60 seconds */
+
+
 typedef struct {
   int sockfd;
   int epfd;
-  long stamp;
+  int refs;              /* timer wheel + events being served */
+  volatile int closing;  /* timed out or closed, not re-armed anymore */
+  twnode_t timer;        /* keep-alive timeout */
+
+  unsigned char *rbuf;  /* receive buffer */
+  size_t rbuf_size;
+  size_t rbuf_len;
+  httpparser_t parser;  /* resumed on the next EPOLLIN */
+  ioqueue_t wq;         /* replies the socket didn't take yet */
+
+  /* a request handed to the I/O pool or waiting on the job's socket,
+   * the client socket is not served (nor armed) until its job is done */
+  httpjob_t job;
+  httpmsg_t *pending;
+  volatile int resume;  /* job done, armed for EPOLLOUT to come back */
 
-  PGconn *pgconn;
-  rbtree_t *cache;
-  rbtree_t *timers;
+  pgpool_t *pgpool;
+  cache_t *cache;
+  twheel_t *timers;
+  thpool_t *iopool;     /* blocking work, NULL: done in place */
   rbtree_t *authdb;
   httpcfg_t *cfg;
 } httpconn_t;
@@ -20,20 +38,24 @@ typedef struct {
 
 httpconn_t *httpconn_new(const int sockfd,
                          const int epfd,
-                         PGconn *pgconn,
-                         rbtree_t *cache,
-                         rbtree_t *timers,
+                         pgpool_t *pgpool,
+                         cache_t *cache,
+                         twheel_t *timers,
+                         thpool_t *iopool,
                          rbtree_t *authdb,
                          httpcfg_t *cfg);
 
-void httpconn_delete(void *conn);
+void httpconn_hold(httpconn_t *conn);
+
+void httpconn_release(httpconn_t *conn);
+
+void httpconn_close(httpconn_t *conn);
+
+void httpconn_timeout(void *conn);
 
 int httpconn_epoll(httpconn_t *conn,
                    const int op);
 
-int httpconn_compare(const void *curr,
-                     const void *conn);
-
 void httpconn_task(void *arg);
 
 void httpconn_expire(void *arg);
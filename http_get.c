@@ -5,10 +5,13 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <pthread.h>
 #include <errno.h>
 #include <time.h>
+#include <dirent.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include <libpq-fe.h>
 #include <libdeflate.h>
 #include "xmalloc.h"
@@ -16,9 +19,11 @@
 #include "util.h"
 #include "sllist.h"
 #include "rbtree.h"
+#include "pg_conn.h"
 #include "thpool.h"
 #include "jwt.h"
 #include "base64.h"
+#include "http_header.h"
 #include "http_msg.h"
 #include "http_cache.h"
 #include "http_cfg.h"
@@ -29,7 +34,9 @@
 
 
 #define MAX_PATH 256
-#define MAX_CWD 64
+
+#define MAX_HDR_FIXED 256   /* rendered headers without their values */
+#define MAX_HDR_SPLICE 256  /* start line, Date, Content-Length/Range */
 
 static const char *content_type[] = {
   "image/png",
@@ -161,7 +168,7 @@ static httpmsg_t *_401_unauthorized(const char *path,
   *ret++ = '\0';
   msg_set_rep_line(rep, 1, 1, 401, "Unauthorized");
   msg_add_body(rep, (unsigned char *)body, len_body);
-  msg_set_body_start(rep, (unsigned char *)body);
+  msg_set_body_start(rep, (unsigned char *)body, len_body);
   itos((unsigned char *)len_str, len_body, 10, ' ');
   D_PRINT("[401] body: \n%s\n", body);
   msg_add_header(rep, "Content-Length", len_str);
@@ -175,7 +182,7 @@ static httpmsg_t *_403_forbidden(const char *path)
   char *body = xstrdup("<html><body>403 Forbidden</body></html>");
   msg_set_rep_line(rep, 1, 1, 403, "Forbidden");
   msg_add_body(rep, (unsigned char *)body, 39);
-  msg_set_body_start(rep, (unsigned char *)body);
+  msg_set_body_start(rep, (unsigned char *)body, 39);
   msg_add_header(rep, "Content-Length", "39");
   return rep;
 }
@@ -187,7 +194,7 @@ static httpmsg_t *_404_not_found(const char *path)
   char *body = xstrdup("<html><body>404 Not Found</body></html>");
   msg_set_rep_line(rep, 1, 1, 404, "Not Found");
   msg_add_body(rep, (unsigned char *)body, 39);
-  msg_set_body_start(rep, (unsigned char *)body);
+  msg_set_body_start(rep, (unsigned char *)body, 39);
   msg_add_header(rep, "Content-Length", "39");
   return rep;
 }
@@ -200,7 +207,7 @@ static httpmsg_t *_302_found(const char *path)
   msg_set_rep_line(rep, 1, 1, 302, "Found");
   msg_add_header(rep, "Location", path);
   msg_add_body(rep, (unsigned char *)body, 35);
-  msg_set_body_start(rep, (unsigned char *)body);
+  msg_set_body_start(rep, (unsigned char *)body, 35);
   msg_add_header(rep, "Content-Length", "35");
   return rep;
 }
@@ -211,77 +218,103 @@ static httpmsg_t *_304_not_modified()
   char *body = xstrdup("<html><body>302 Not Modified</body></html>");
   msg_set_rep_line(rep, 1, 1, 304, "Not Modified");
   msg_add_body(rep, (unsigned char *)body, 42);
-  msg_set_body_start(rep, (unsigned char *)body);
+  msg_set_body_start(rep, (unsigned char *)body, 42);
   msg_add_header(rep, "Content-Length", "42");
   return rep;
 }
 
-static size_t _process_range(httpmsg_t *rep,
-                             char *range_str,
-                             size_t *len_range,
-                             const size_t len_body)
+/* return - 1: satisfiable, *start and *len_range set,
+ *          0: not, the range is past the end (or the body is empty) */
+static int _process_range(char *range,
+                          char *range_str,
+                          size_t *start,
+                          size_t *len_range,
+                          const size_t len_body)
 {
   size_t range_si;  /* range start */
   size_t range_ei;  /* range end */
-  char range[64];
 
   char *range_s = split_kv(range_str, '=');
   char *range_e = split_kv(range_s, '-');
 
-  range_si = atoi(range_s);
-  /* req: bytes=xxxx-xxxx */
-  if (*range_e) {
-    range_ei = atol(range_e);
-    *len_range = range_ei - range_si + 1;
-    sprintf(range, "bytes %lu-%lu/%lu", range_si, range_ei, len_body);
+  /* req: bytes=-xxxx, the last xxxx bytes */
+  if (*range_s == '\0') {
+    size_t suffix = atol(range_e);
+    range_si = suffix < len_body ? len_body - suffix : 0;
+    if (suffix == 0) range_si = len_body;
   }
-  /* req: bytes=xxxx- */
-  else {
-    *len_range = len_body - range_si;
-    //sprintf(range, "bytes %lu-%lu/%lu", range_si, len_body - 1, len_body);
-    sprintf(range, "bytes %lu-/%lu", range_si, len_body);
+  else
+    range_si = atol(range_s);
+
+  if (range_si >= len_body) {
+    sprintf(range, "bytes */%lu", len_body);
+    *start = 0;
+    *len_range = 0;
+    return 0;
   }
 
-  msg_add_header(rep, "Content-Range", range);
+  /* req: bytes=xxxx-xxxx, the range never goes past the end of the body */
+  range_ei = len_body - 1;
+  if (*range_s && *range_e && (size_t)atol(range_e) < range_ei)
+    range_ei = atol(range_e);
+  /* an end before the start, the whole body from the start */
+  if (range_ei < range_si) range_ei = len_body - 1;
+
+  *start = range_si;
+  *len_range = range_ei - range_si + 1;
+  sprintf(range, "bytes %lu-%lu/%lu", range_si, range_ei, len_body);
   //D_PRINT("[GET_REP] Content-Range: %s\n", range);
-  return range_si;
+  return 1;
 }
 
-
-static void _add_common_headers(httpmsg_t *rep,
-                                const char *ctype,
-                                const httpcache_t *cd,
-                                const httpcfg_t *cfg)
+/* the headers which are the same for every reply of a cached file */
+static void _render_headers(httpcache_t *cd,
+                            const char *ctype,
+                            const httpcfg_t *cfg)
 {
-  msg_add_header(rep, "Server", SVR_VERSION);
-  msg_add_header(rep, "Connection", "Keep-Alive");
-  msg_add_header(rep, "Accept-Ranges", "bytes");
-
-  /* response - cache control */
   char len_str[16];
-  char max_age[16];
   itos((unsigned char *)len_str, cfg->max_age, 10, ' ');
-  char *ret = strbld(max_age, "max-age=");
-  ret = strbld(ret, len_str);
-  *ret++ = '\0';
-  //D_PRINT("[CACHE] %s\n", max_age);
-  msg_add_header(rep, "Cache-Control", max_age);
 
-  char rep_date[30]; /* reply start date */
-  time_t rep_time = time(NULL);
-  gmt_date(rep_date, &rep_time);
-  msg_add_header(rep, "Date", rep_date);
+  cd->hdr = xmalloc(strlen(cd->etag) + strlen(cd->last_modified) +
+                    strlen(ctype) + MAX_HDR_FIXED);
+  char *ret = strbld(cd->hdr, "Server: " SVR_VERSION "\r\n"
+                              "Connection: Keep-Alive\r\n"
+                              "Accept-Ranges: bytes\r\n"
+                              "Cache-Control: max-age=");
+  ret = strbld(ret, len_str);
   /* ETag is a strong validator */
-  msg_add_header(rep, "ETag", cd->etag);
-  msg_add_header(rep, "Last-Modified", cd->last_modified);
-  msg_add_header(rep, "Content-Type", ctype);
+  ret = strbld(ret, "\r\nETag: ");
+  ret = strbld(ret, cd->etag);
+  ret = strbld(ret, "\r\nLast-Modified: ");
+  ret = strbld(ret, cd->last_modified);
+  ret = strbld(ret, "\r\nContent-Type: ");
+  ret = strbld(ret, ctype);
+  ret = strbld(ret, "\r\n");
+  cd->len_hdr = ret - cd->hdr;
+
+  ret = strbld(ret, "Content-Encoding: deflate\r\n"
+                    "Vary: Accept-Encoding\r\n");
+  cd->len_hdr_zipped = ret - cd->hdr;
 }
 
-static int _cache_altered(httpmsg_t *rep,
-                          const httpcache_t *cd,
+/* Date changes once a second, each thread keeps the last one */
+static const char *_rep_date()
+{
+  static __thread time_t last = 0;
+  static __thread char date[30];
+
+  time_t now = time(NULL);
+  if (now != last) {
+    gmt_date(date, &now);
+    last = now;
+  }
+  return date;
+}
+
+static int _cache_altered(const httpcache_t *cd,
                           const httpmsg_t *req)
 {
-  char *cache_ctl = msg_header_value(req, "Cache-Control");
+  char *cache_ctl = msg_field_value(req, HDR_CACHE_CONTROL);
   if (!cache_ctl) return 1;  /* no cache control */
 
   if (strstr(cache_ctl, "no-store")) {
@@ -298,7 +331,7 @@ static int _cache_altered(httpmsg_t *rep,
     if (max_age[0] == '0') {
       D_PRINT("[CACHE-REQ] max-age = %s\n", max_age);
       /* req: etag, last_modified */
-      char *etag = msg_header_value(req, "If-None-Match");
+      char *etag = msg_field_value(req, HDR_IF_NONE_MATCH);
       if (etag) {
         if (strcmp(cd->etag, etag) == 0) {
           D_PRINT("[CACHE-REQ] etag = %s\n", etag);
@@ -306,7 +339,7 @@ static int _cache_altered(httpmsg_t *rep,
         }
       }
       else {
-        char *last_modified = msg_header_value(req, "If-Modified-Since");
+        char *last_modified = msg_field_value(req, HDR_IF_MODIFIED_SINCE);
         if (last_modified) {
           if (strcmp(cd->last_modified, last_modified) == 0) {
             D_PRINT("[CACHE-REQ] last_modified = %s\n", last_modified);
@@ -319,113 +352,158 @@ static int _cache_altered(httpmsg_t *rep,
   return 1;  /* no cache control or modified */
 }
 
-static httpmsg_t *_compressed_rep(char *range,
-                                  const char *ctype,
-                                  const httpcache_t *cd,
-                                  const httpcfg_t *cfg,
-                                  const httpmsg_t *req)
+/* the reply head is the rendered headers of the file, with the start line,
+ * Date, Content-Length (and Content-Range) around, returns the offset of
+ * the body part to send, *len its length */
+static size_t _rep_head(httpmsg_t *rep,
+                        char *range_str,
+                        const char *hdr,
+                        const size_t len_hdr,
+                        const size_t len_body,
+                        size_t *len)
 {
   char len_str[16];
-  httpmsg_t *rep;
-
-  if (!range) {
-    if (!_cache_altered(rep, cd, req)) {
-      return _304_not_modified();
-    }
+  char range[64];
+  size_t range_s = 0;
+  char *ret;
 
+  rep->head = xmalloc(len_hdr + MAX_HDR_SPLICE);
+  if (!range_str) {
     /* todo: Cache-Control's other situations should be considered... */
-    rep = msg_new();
-    msg_set_rep_line(rep, 1, 1, 200, "OK");
-    msg_set_body_start(rep, cd->body_zipped);
-    itos((unsigned char *)len_str, cd->len_zipped, 10, ' ');
-    msg_add_header(rep, "Content-Length", len_str);
-    //D_PRINT("[GET_REP] Content-Length = %s\n", len_str);
+    rep->code = 200;
+    ret = strbld(rep->head, "HTTP/1.1 200 OK\r\n");
+    *len = len_body;
   }
   else {
-    size_t range_s;
-    size_t len_range;
-    rep = msg_new();
-    msg_set_rep_line(rep, 1, 1, 206, "Partial Content");
-    range_s = _process_range(rep, range, &len_range, cd->len_zipped);
-    //D_PRINT("[GET_REP] range start: %ld, length: %ld\n", range_s, len_range);
-    msg_set_body_start(rep, cd->body_zipped + range_s);
-    itos((unsigned char *)len_str, len_range, 10, ' ');
-    msg_add_header(rep, "Content-Length", len_str);
-  }
-
-  msg_add_header(rep, "Content-Encoding", "deflate");
-  msg_add_header(rep, "Vary", "Accept-Encoding");
-  msg_add_zipped_body(rep, cd->body_zipped, cd->len_zipped);
-  _add_common_headers(rep, ctype, cd, cfg);
+    if (_process_range(range, range_str, &range_s, len, len_body)) {
+      rep->code = 206;
+      ret = strbld(rep->head, "HTTP/1.1 206 Partial Content\r\n");
+    }
+    else {
+      /* an empty body, the Content-Range tells the length */
+      rep->code = 416;
+      ret = strbld(rep->head, "HTTP/1.1 416 Range Not Satisfiable\r\n");
+    }
+    //D_PRINT("[GET_REP] range start: %ld, length: %ld\n", range_s, *len);
+    ret = strbld(ret, "Content-Range: ");
+    ret = strbld(ret, range);
+    ret = strbld(ret, "\r\n");
+  }
+  itos((unsigned char *)len_str, *len, 10, ' ');
+
+  memcpy(ret, hdr, len_hdr);
+  ret += len_hdr;
+  ret = strbld(ret, "Date: ");
+  ret = strbld(ret, _rep_date());
+  ret = strbld(ret, "\r\nContent-Length: ");
+  ret = strbld(ret, len_str);
+  ret = strbld(ret, "\r\n\r\n");
+  rep->len_head = ret - rep->head;
+  return range_s;
+}
+
+static httpmsg_t *_cached_rep(char *range_str,
+                              const int zipped,
+                              const httpcache_t *cd,
+                              const httpmsg_t *req)
+{
+  unsigned char *body = zipped ? cd->body_zipped : cd->body;
+  size_t len_body = zipped ? cd->len_zipped : cd->len_body;
+  size_t len_hdr = zipped ? cd->len_hdr_zipped : cd->len_hdr;
+
+  if (!range_str && !_cache_altered(cd, req)) {
+    return _304_not_modified();
+  }
+
+  size_t len;
+  httpmsg_t *rep = msg_new();
+  size_t range_s = _rep_head(rep, range_str, cd->hdr, len_hdr, len_body,
+                             &len);
+  msg_set_body_start(rep, body + range_s, len);
+
+  if (zipped)
+    msg_add_zipped_body(rep, body, len_body);
+  else
+    msg_add_body(rep, body, len_body);
   return rep;
 }
 
-static httpmsg_t *_uncompressed_rep(char *range,
-                                    const char *ctype,
-                                    const httpcache_t *cd,
-                                    const httpcfg_t *cfg,
-                                    const httpmsg_t *req)
+/* a large file isn't read into the cache, the reply carries the opened
+ * file and the body goes from the page cache to the socket (sendfile) */
+static httpmsg_t *_file_rep(struct stat *sb,
+                            const char *path,
+                            const char *ospath,
+                            const char *ctype,
+                            const httpcfg_t *cfg,
+                            const httpmsg_t *req)
 {
-  char len_str[16];
-  httpmsg_t *rep;
+  char etag[30];
+  char modified[30];
+  sprintf(etag, "\"%lu-%lu-%ld\"", sb->st_ino, sb->st_size, sb->st_mtime);
+  gmt_date(modified, &sb->st_mtime);
 
-  if (!range) {
-    if (!_cache_altered(rep, cd, req)) {
-      return _304_not_modified();
-    }
+  /* only the validators and the headers are used */
+  httpcache_t cd;
+  cd.etag = etag;
+  cd.last_modified = modified;
 
-    rep = msg_new();
-    msg_set_rep_line(rep, 1, 1, 200, "OK");
-    msg_set_body_start(rep, cd->body);
-    itos((unsigned char *)len_str, cd->len_body, 10, ' ');
-    msg_add_header(rep, "Content-Length", len_str);
+  char *range_str = msg_field_value(req, HDR_RANGE);
+  if (!range_str && !_cache_altered(&cd, req)) {
+    return _304_not_modified();
   }
-  else {
-    size_t range_s;
-    size_t len_range;
-    rep = msg_new();
-    msg_set_rep_line(rep, 1, 1, 206, "Partial Content");
-    range_s = _process_range(rep, range, &len_range, cd->len_body);
-    //D_PRINT("[GET_REP] range start: %ld, length: %ld\n", range_s, len_range);
-    msg_set_body_start(rep, cd->body + range_s);
-    itos((unsigned char *)len_str, len_range, 10, ' ');
-    msg_add_header(rep, "Content-Length", len_str);
-  }
-
-  msg_add_body(rep, cd->body, cd->len_body);
-  _add_common_headers(rep, ctype, cd, cfg);
+
+  int fd = open(ospath, O_RDONLY);
+  if (fd == -1) return _404_not_found(path);
+
+  size_t len;
+  httpmsg_t *rep = msg_new();
+  _render_headers(&cd, ctype, cfg);
+  rep->off = _rep_head(rep, range_str, cd.hdr, cd.len_hdr, sb->st_size, &len);
+  xfree(cd.hdr);
+  rep->fd = fd;
+  msg_set_body_start(rep, NULL, len);
+  D_PRINT("[GET_REP] <%s> sendfile %ld bytes\n", path, len);
   return rep;
 }
 
-static httpmsg_t * _prepare_rep(const char *ctype,
-                                const int mtype,
+static httpmsg_t * _prepare_rep(const int mtype,
                                 const httpcache_t *cd,
-                                const httpcfg_t *cfg,
                                 const httpmsg_t *req)
 {
-  char *range_str = msg_header_value(req, "Range");
+  char *range_str = msg_field_value(req, HDR_RANGE);
   /* compressed */
-  char *zip_enc = msg_header_value(req, "Accept-Encoding");
+  char *zip_enc = msg_field_value(req, HDR_ACCEPT_ENCODING);
   //D_PRINT("[PARSER] zip_enc = %s\n", zip_enc);
-  if (mtype == MIME_TXT && zip_enc && strstr(zip_enc, "deflate"))
-    return _compressed_rep(range_str, ctype, cd, cfg, req);
-  else
-    return _uncompressed_rep(range_str, ctype, cd, cfg, req);
+  int zipped = mtype == MIME_TXT && zip_enc && strstr(zip_enc, "deflate");
+  return _cached_rep(range_str, zipped, cd, req);
 }
 
-static void _read_to_cache(httpcache_t *data,
-                           struct stat *sb,
-                           const char *path,
-                           const char *ospath,
-                           const int mime_type)
+/* the file may have changed since its stat(), the entry is made of what
+ * the opened file holds; return -1 if it is gone */
+static int _read_to_cache(httpcache_t *data,
+                          struct stat *sb,
+                          const char *path,
+                          const char *ospath,
+                          const char *ctype,
+                          const int mime_type,
+                          const httpcfg_t *cfg)
 {
+  int fd = open(ospath, O_RDONLY);
+  if (fd == -1) return -1;
+  FILE *f = fdopen(fd, "r");
+  if (!f || fstat(fd, sb) == -1) {
+    if (f) fclose(f);
+    else close(fd);
+    return -1;
+  }
+
   char *etag = xmalloc(30);
   char *modified = xmalloc(30);
   sprintf(etag, "\"%lu-%lu-%ld\"", sb->st_ino, sb->st_size, sb->st_mtime);
   gmt_date(modified, &sb->st_mtime);
   size_t len_body = sb->st_size;
 
-  unsigned char *body = io_fread(ospath, len_body);
+  unsigned char *body = io_fread_pipe(f, len_body);
   //D_PRINT("[IO] len_body: %ld\n", len_body);
   //D_PRINT("[IO] body:\n%s\n", (char *)body);
 
@@ -447,30 +525,83 @@ static void _read_to_cache(httpcache_t *data,
     httpcache_set(data, xstrdup(path), etag, modified,
                   body, len_body, NULL, 0);
   }
+  _render_headers(data, ctype, cfg);
+  return 0;
 }
 
-static httpmsg_t *_get_rep_msg(rbtree_t *cache,
+/* a file to read into the cache, off the network workers if they can't
+ * block */
+typedef struct {
+  cache_t *cache;
+  unsigned long gen;  /* of the cache before the file was looked at */
+  httpcache_t *cd;  /* the reply's entry, held until it is sent */
+  char *path;
+  char ospath[MAX_PATH];
+  struct stat sb;
+  int ctype;
+  int mime_type;
+  const httpcfg_t *cfg;
+  const httpmsg_t *req;
+} getjob_t;
+
+/* a new entry, a stale one is replaced, not rebuilt in place; the
+ * concurrent misses of a file share a single load; return the entry
+ * held, NULL if the file is gone */
+static httpcache_t *_load(getjob_t *j)
+{
+  char etag[30];
+  httpcache_t *cd;
+
+  sprintf(etag, "\"%lu-%lu-%ld\"", j->sb.st_ino, j->sb.st_size,
+          j->sb.st_mtime);
+  cacheflight_t *f = cache_flight(j->cache, j->path, etag, &cd);
+  if (!f) return cd;
+
+  cd = httpcache_new();
+  if (_read_to_cache(cd, &j->sb, j->path, j->ospath,
+                     content_type[j->ctype], j->mime_type, j->cfg) == -1) {
+    xfree(cd);
+    cache_land(j->cache, f, NULL);
+    return NULL;
+  }
+  cache_put(j->cache, cd, j->gen);
+  cache_land(j->cache, f, cd);
+  D_PRINT("[CACHE] <%s> loaded!\n", j->path);
+  return cd;
+}
+
+static httpmsg_t *_cache_load(getjob_t *j)
+{
+  j->cd = _load(j);
+  if (!j->cd) return _404_not_found(j->path);
+  return _prepare_rep(j->mime_type, j->cd, j->req);
+}
+
+/* return NULL if the file has to be read and it may not block,
+ * j holds what the read needs, j->cd the entry of a cached reply */
+static httpmsg_t *_get_rep_msg(cache_t *cache,
                                char *path,
                                const httpcfg_t *cfg,
-                               const httpmsg_t *req)
+                               const httpmsg_t *req,
+                               getjob_t *j,
+                               const int may_block)
 {
-  char curdir[MAX_CWD];
   char ospath[MAX_PATH];
   char *ret;
 
-  if (!getcwd(curdir, MAX_CWD)) {
-    D_PRINT("[SYS] Couldn't read %s\n", curdir);
-  }
+  j->cd = NULL;
+  if (strlen(cfg->docroot) + strlen(path) >= MAX_PATH)
+    return _404_not_found(path);
 
   if ((strcmp(path, "/demo/login.html") == 0 ||
        strcmp(path, "/demo/script/login.js") == 0 ||
        strcmp(path, "/demo/css/login.css") == 0)) {
-    ret = strbld(ospath, curdir);
+    ret = strbld(ospath, cfg->docroot);
     ret = strbld(ret, path);
     *ret++ = '\0';
   }
   else {
-    char *cookie = msg_header_value(req, "Cookie");
+    char *cookie = msg_field_value(req, HDR_COOKIE);
     if (!cookie)
       return _401_unauthorized(path, "Not Authorized or login needed!");
 
@@ -487,7 +618,7 @@ static httpmsg_t *_get_rep_msg(rbtree_t *cache,
         return _401_unauthorized(path, "Illegal, please verify yourself!");
       }
       /* authenticated! */
-      ret = strbld(ospath, curdir);
+      ret = strbld(ospath, cfg->docroot);
       ret = strbld(ret, path);
       *ret++ = '\0';
     }
@@ -496,24 +627,37 @@ static httpmsg_t *_get_rep_msg(rbtree_t *cache,
       return _401_unauthorized(path, "You haven't logged in!");
   }
 
-  struct stat sb;
-  /* file does not exist */
-  if (stat(ospath, &sb) == -1)
-    return _404_not_found(path);
-  /* directory not allowed */
-  if (S_ISDIR(sb.st_mode))
-    return _403_forbidden(path);
-
   /* check if the body is in the cache */
   int ctype = HTML;  /* default to HTML */
   char *ext = find_ext(path);
   int mime_type = _find_content_type(&ctype, ext);
-  httpcache_t cdata;
-  cdata.path = path;
 
-  pthread_mutex_lock(&cache->mutex);
-  httpcache_t *cd = (httpcache_t *)rbtree_search(cache, &cdata);
-  pthread_mutex_unlock(&cache->mutex);
+  /* a change of the file under a watched docroot drops its entry, a hit
+   * needs no stat(); only the changes made by this host are seen, those
+   * of the other hosts of a network fs are caught by max-age */
+  j->gen = cache_gen(cache, path);
+  httpcache_t *cd = cache_get(cache, path);
+  if (cd && cache->watched && mstime() - cd->stamp < cfg->max_age) {
+    j->cd = cd;
+    return _prepare_rep(mime_type, cd, req);
+  }
+
+  struct stat sb;
+  /* file does not exist */
+  if (stat(ospath, &sb) == -1) {
+    if (cd) httpcache_release(cd);
+    return _404_not_found(path);
+  }
+  /* directory not allowed */
+  if (S_ISDIR(sb.st_mode)) {
+    if (cd) httpcache_release(cd);
+    return _403_forbidden(path);
+  }
+  /* large files are never cached */
+  if ((size_t)sb.st_size > cfg->sendfile_size) {
+    if (cd) httpcache_release(cd);
+    return _file_rep(&sb, path, ospath, content_type[ctype], cfg, req);
+  }
 
   if (cd) {
     /* data exceeds max-age, refresh it... */
@@ -522,37 +666,46 @@ static httpmsg_t *_get_rep_msg(rbtree_t *cache,
       char etag[30];
       sprintf(etag, "\"%lu-%lu-%ld\"", sb.st_ino, sb.st_size, sb.st_mtime);
       if (strcmp(cd->etag, etag) != 0) {
-        httpcache_clear(cd);
-        _read_to_cache(cd, &sb, path, ospath, mime_type);
-        D_PRINT("[CACHE] <%s> reloaded!\n", cd->path);
+        /* changed, the readers of the old entry keep it until they're done */
+        httpcache_release(cd);
+        cd = NULL;
       }
-      else
+      else {
         D_PRINT("[CACHE] <%s> revalidated!\n", cd->path);
-      cd->stamp = cur_time;
+        cd->stamp = cur_time;
+      }
+    }
+    if (cd) {
+      j->cd = cd;
+      return _prepare_rep(mime_type, cd, req);
     }
-    return _prepare_rep(content_type[ctype], mime_type, cd, cfg, req);
   }
-  /* not in the cache, create it... */
-  cd = httpcache_new();
-  _read_to_cache(cd, &sb, path, ospath, mime_type);
-  D_PRINT("[CACHE] <%s> added!\n", path);
-  pthread_mutex_lock(&cache->mutex);
-  rbtree_insert(cache, cd);
-  pthread_mutex_unlock(&cache->mutex);
-  return _prepare_rep(content_type[ctype], mime_type, cd, cfg, req);
+
+  /* not in the cache or changed, (re)load it... */
+  j->cache = cache;
+  j->path = path;
+  strcpy(j->ospath, ospath);
+  j->sb = sb;
+  j->ctype = ctype;
+  j->mime_type = mime_type;
+  j->cfg = cfg;
+  j->req = req;
+  if (!may_block) return NULL;
+  return _cache_load(j);
 }
 
-void http_get(const int sockfd,
-              rbtree_t *cache,
-              char *path,
-              const httpcfg_t *cfg,
-              const httpmsg_t *req)
+static void _send_rep(ioqueue_t *wq,
+                      httpmsg_t *rep)
 {
-  httpmsg_t *rep = _get_rep_msg(cache, path, cfg, req);
-  /* send headers*/
-  msg_send_headers(sockfd, rep);
-  /* send body */
-  msg_send_body(sockfd, rep->body_s, rep->len_body);
+  if (rep->fd != -1) {
+    msg_send_headers(wq, rep);
+    /* the queue owns the file from now on */
+    ioqueue_sendfile(wq, rep->fd, rep->off, rep->len_body_s);
+    rep->fd = -1;
+  }
+  else
+    /* headers and body (or the requested range of it) in one go */
+    msg_send(wq, rep, rep->body_s, rep->len_body_s);
 
   if (rep->code == 401 || rep->code == 403 || rep->code == 404 ||
       rep->code == 302 || rep->code == 304)
@@ -560,3 +713,158 @@ void http_get(const int sockfd,
   else
     msg_delete(rep, 0);
 }
+
+/* on the I/O pool */
+static void _get_job(ioqueue_t *wq,
+                     void *arg)
+{
+  getjob_t *j = (getjob_t *)arg;
+  _send_rep(wq, _cache_load(j));
+  if (j->cd) httpcache_release(j->cd);
+  xfree(j);
+}
+
+void http_get(ioqueue_t *wq,
+              cache_t *cache,
+              char *path,
+              const httpcfg_t *cfg,
+              const httpmsg_t *req,
+              httpjob_t *job)
+{
+  getjob_t j;
+  httpmsg_t *rep = _get_rep_msg(cache, path, cfg, req, &j, job == NULL);
+  if (rep == NULL) {
+    /* cold file, read it off the network workers */
+    job->routine = _get_job;
+    job->arg = xmalloc(sizeof(getjob_t));
+    memcpy(job->arg, &j, sizeof(getjob_t));
+    return;
+  }
+  _send_rep(wq, rep);
+  if (j.cd) httpcache_release(j.cd);
+}
+
+/* a snapshot's record is cached if its file didn't change since, the
+ * bodies stay in the mapping */
+static int _snap_add(cache_t *cache,
+                     const cacherec_t *rec,
+                     void *arg)
+{
+  const httpcfg_t *cfg = (const httpcfg_t *)arg;
+  char ospath[MAX_PATH];
+  char etag[30];
+  struct stat sb;
+
+  if (strlen(cfg->docroot) + strlen(rec->path) >= MAX_PATH) return 0;
+  strbld(strbld(ospath, cfg->docroot), rec->path);
+
+  unsigned long gen = cache_gen(cache, rec->path);
+  if (stat(ospath, &sb) == -1 || !S_ISREG(sb.st_mode)) return 0;
+  sprintf(etag, "\"%lu-%lu-%ld\"", sb.st_ino, sb.st_size, sb.st_mtime);
+  if (strcmp(etag, rec->etag) != 0) return 0;
+
+  int ctype = HTML;
+  _find_content_type(&ctype, find_ext(rec->path));
+
+  httpcache_t *cd = httpcache_new();
+  httpcache_set(cd, xstrdup(rec->path), xstrdup(rec->etag),
+                xstrdup(rec->last_modified), rec->body, rec->len_body,
+                rec->body_zipped, rec->len_zipped);
+  cd->mapped = 1;
+  /* max-age may have changed */
+  _render_headers(cd, content_type[ctype], cfg);
+  cache_put(cache, cd, gen);
+  httpcache_release(cd);
+  return 1;
+}
+
+/* on the I/O pool */
+static void _warm_job(void *arg)
+{
+  getjob_t *j = (getjob_t *)arg;
+  httpcache_t *cd = _load(j);
+  if (cd) httpcache_release(cd);
+  xfree(j->path);
+  xfree(j);
+}
+
+/* the files not cached yet, hidden ones aside, until their sizes fill
+ * the cache; return the bytes queued */
+static size_t _warm_dir(cache_t *cache,
+                        const char *dir,
+                        const httpcfg_t *cfg,
+                        thpool_t *pool,
+                        size_t bytes)
+{
+  char ospath[MAX_PATH];
+  snprintf(ospath, MAX_PATH, "%s%s", cfg->docroot, dir);
+  DIR *d = opendir(ospath);
+  if (!d) return bytes;
+
+  struct dirent *e;
+  while ((e = readdir(d)) && bytes < cfg->cache_size) {
+    if (e->d_name[0] == '.') continue;
+
+    getjob_t *j = xmalloc(sizeof(getjob_t));
+    char path[MAX_PATH];
+    if ((size_t)snprintf(path, MAX_PATH, "%s/%s", dir, e->d_name) +
+        strlen(cfg->docroot) >= MAX_PATH) {
+      xfree(j);
+      continue;
+    }
+    strbld(strbld(j->ospath, cfg->docroot), path);
+
+    j->gen = cache_gen(cache, path);
+    if (stat(j->ospath, &j->sb) == -1) {
+      xfree(j);
+      continue;
+    }
+    if (S_ISDIR(j->sb.st_mode)) {
+      xfree(j);
+      bytes = _warm_dir(cache, path, cfg, pool, bytes);
+      continue;
+    }
+
+    httpcache_t *cd = cache_get(cache, path);
+    if (cd) httpcache_release(cd);
+    if (cd || !S_ISREG(j->sb.st_mode) ||
+        (size_t)j->sb.st_size > cfg->sendfile_size) {
+      xfree(j);
+      continue;
+    }
+
+    j->cache = cache;
+    j->cd = NULL;
+    j->path = xstrdup(path);
+    j->ctype = HTML;
+    j->mime_type = _find_content_type(&j->ctype, find_ext(path));
+    j->cfg = cfg;
+    j->req = NULL;
+    bytes += j->sb.st_size;
+    thpool_add_task(pool, _warm_job, j);
+  }
+  closedir(d);
+  return bytes;
+}
+
+void http_get_warm(cache_t *cache,
+                   const httpcfg_t *cfg,
+                   thpool_t *pool)
+{
+  if (cfg->snapshot) {
+    int n = cache_load(cache, cfg->snapshot, _snap_add, (void *)cfg);
+    if (n >= 0)
+      printf("[CACHE] %d files from the snapshot %s\n", n, cfg->snapshot);
+  }
+
+  if (cfg->warm_dir) {
+    char dir[MAX_PATH];
+    size_t len = strlen(cfg->warm_dir);
+    if (len >= MAX_PATH) return;
+    strcpy(dir, cfg->warm_dir);
+    /* the request paths have no trailing '/' */
+    while (len > 0 && dir[len - 1] == '/') dir[--len] = '\0';
+    size_t bytes = _warm_dir(cache, dir, cfg, pool, 0);
+    printf("[CACHE] warming up %s, %zu bytes\n", cfg->warm_dir, bytes);
+  }
+}
@@ -3,6 +3,7 @@
 
 #include <stdio.h>
 #include <string.h>
+#include <strings.h>
 #include "xmalloc.h"
 #include "http_header.h"
 
@@ -10,6 +11,32 @@
 #include "debug.h"
 
 
+/* perfect hash over the known header names,
+ *   (len + name[0] + 7 * name[len - 1]) & 15, letters lowered
+ * no two known names share a slot, so one compare confirms a hit */
+#define HDR_SLOTS 16
+
+typedef struct {
+  const char *name;
+  int len;
+  int id;
+} hdrslot_t;
+
+static const hdrslot_t _hdr_slots[HDR_SLOTS] = {
+  [1] = {"accept-encoding", 15, HDR_ACCEPT_ENCODING},
+  [2] = {"content-type", 12, HDR_CONTENT_TYPE},
+  [4] = {"cache-control", 13, HDR_CACHE_CONTROL},
+  [6] = {"transfer-encoding", 17, HDR_TRANSFER_ENCODING},
+  [8] = {"host", 4, HDR_HOST},
+  [9] = {"content-length", 14, HDR_CONTENT_LENGTH},
+  [10] = {"range", 5, HDR_RANGE},
+  [12] = {"cookie", 6, HDR_COOKIE},
+  [13] = {"if-modified-since", 17, HDR_IF_MODIFIED_SINCE},
+  [14] = {"if-none-match", 13, HDR_IF_NONE_MATCH},
+  [15] = {"connection", 10, HDR_CONNECTION}
+};
+
+
 httpheader_t *httpheader_new()
 {
   httpheader_t *header = xmalloc(sizeof(httpheader_t));
@@ -38,3 +65,17 @@ void httpheader_print(const void *header)
   httpheader_t *p = (httpheader_t *)header;
   D_PRINT("[HEADER] %s: %s\n", p->kvpair, p->value);
 }
+
+/* HDR_xxx of a header name (case-insensitive), HDR_UNKNOWN if not known */
+int httpheader_id(const char *name,
+                  const int len)
+{
+  if (len == 0) return HDR_UNKNOWN;
+  unsigned int first = (unsigned char)name[0] | 0x20;
+  unsigned int last = (unsigned char)name[len - 1] | 0x20;
+  int h = (len + first + 7 * last) & (HDR_SLOTS - 1);
+  const hdrslot_t *slot = &_hdr_slots[h];
+  if (slot->len != len || strncasecmp(slot->name, name, len) != 0)
+    return HDR_UNKNOWN;
+  return slot->id;
+}
@@ -5,11 +5,36 @@
 #define _HTTP_HEADER_H_
 
 
+/* the request headers the server looks at, resolved once at parse time */
+#define HDR_ACCEPT_ENCODING 0
+#define HDR_CACHE_CONTROL 1
+#define HDR_CONNECTION 2
+#define HDR_CONTENT_LENGTH 3
+#define HDR_CONTENT_TYPE 4
+#define HDR_COOKIE 5
+#define HDR_HOST 6
+#define HDR_IF_MODIFIED_SINCE 7
+#define HDR_IF_NONE_MATCH 8
+#define HDR_RANGE 9
+#define HDR_TRANSFER_ENCODING 10
+#define HDR_KNOWN 11     /* number of known headers */
+#define HDR_UNKNOWN -1   /* any other header */
+
+
 typedef struct {
   char *kvpair;
   char *value;
 } httpheader_t;
 
+/* a request header, name and value are slices of the receive buffer,
+ * terminated in place so they can be used as C strings as well */
+typedef struct {
+  char *name;
+  char *value;
+  int len_name;
+  int len_value;
+} httpfield_t;
+
 
 httpheader_t *httpheader_new();
 
@@ -20,5 +45,8 @@ int httpheader_compare(const void *curr,
 
 void httpheader_print(const void *header);
 
+int httpheader_id(const char *name,
+                  const int len);
+
 
 #endif
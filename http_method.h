@@ -5,19 +5,44 @@
 #define _HTTP_METHOD_H_
 
 
-/* GET */
-void http_get(const int sockfd,
-              rbtree_t *cache,
+/* work left by a method, the request is kept until it is done:
+ * - routine: blocking (SQL, cold file reads), run on the I/O pool,
+ *   it may leave a poll job to go on with
+ * - poll: non-blocking, run by the connection each time fd is ready,
+ *   returns the epoll events it waits for, 0 when the reply is sent,
+ *   -1 when the reply is cut (the connection is closed); it is parked
+ *   while the client doesn't take the replies, abort() drops it */
+typedef struct {
+  void (*routine)(ioqueue_t *wq, void *arg);
+  int (*poll)(ioqueue_t *wq, void *arg);
+  void (*abort)(void *arg);
+  int fd;
+  int events;               /* waited for on fd, 0: parked */
+  void *arg;
+} httpjob_t;
+
+
+/* GET, job = NULL: may block */
+void http_get(ioqueue_t *wq,
+              cache_t *cache,
               char *path,
               const httpcfg_t *cfg,
-              const httpmsg_t *req);
+              const httpmsg_t *req,
+              httpjob_t *job);
+
+/* the snapshot of cfg, then the files of cfg's warm-up directory, read
+ * on the pool */
+void http_get_warm(cache_t *cache,
+                   const httpcfg_t *cfg,
+                   thpool_t *pool);
 
-/* POST */
-void http_post(const int sockfd,
-               PGconn *pgconn,
+/* POST, job = NULL: may block */
+void http_post(ioqueue_t *wq,
+               pgpool_t *pgpool,
                rbtree_t *authdb,
                const httpcfg_t *cfg,
-               const httpmsg_t *req);
+               const httpmsg_t *req,
+               httpjob_t *job);
 
 
 #endif
@@ -3,7 +3,11 @@
 
 #include <stdio.h>
 #include <string.h>
+#include <strings.h>
+#include <unistd.h>
 #include <pthread.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
 #include "xmalloc.h"
 #include "sllist.h"
 #include "memcpy_sse2.h"
@@ -26,8 +30,15 @@ httpmsg_t *msg_new()
   msg->headers = sll_new(httpheader_compare,
                          httpheader_delete,
                          httpheader_print);
+  msg->fields = NULL;
+  msg->nfields = 0;
+  memset(msg->known, 0xff, sizeof(msg->known));
   msg->len_startline = 0;
   msg->len_headers = 0;
+  msg->head = NULL;
+  msg->len_head = 0;
+  msg->fd = -1;
+  msg->off = 0;
 
   msg->method = METHOD_GET;
   msg->path = NULL;
@@ -38,14 +49,43 @@ httpmsg_t *msg_new()
   return msg;
 }
 
+/* the request and its field table are a single allocation,
+ * the fields themselves point into the receive buffer */
+httpmsg_t *msg_new_req()
+{
+  httpmsg_t *msg = xmalloc(sizeof(httpmsg_t) +
+                           MAX_REQ_FIELDS * sizeof(httpfield_t));
+  msg->headers = NULL;
+  msg->fields = (httpfield_t *)(msg + 1);
+  msg->nfields = 0;
+  memset(msg->known, 0xff, sizeof(msg->known));
+  msg->len_startline = 0;
+  msg->len_headers = 0;
+  msg->head = NULL;
+  msg->len_head = 0;
+  msg->fd = -1;
+  msg->off = 0;
+
+  msg->method = METHOD_GET;
+  msg->path = NULL;
+  msg->len_path = 0;
+  msg->status = NULL;
+
+  msg->body = NULL;
+  msg->body_zipped = NULL;
+  msg->len_body = 0;
+  return msg;
+}
+
 void msg_delete(httpmsg_t *msg,
                 const int delbody)
 {
   if (!msg) return;
-  if (msg->path) xfree(msg->path);
   if (msg->status) xfree(msg->status);
+  if (msg->head) xfree(msg->head);
+  if (msg->fd != -1) close(msg->fd);
 
-  sll_delete(msg->headers);
+  if (msg->headers) sll_delete(msg->headers);
 
   if (delbody) {
     if (msg->body) xfree(msg->body);
@@ -57,6 +97,19 @@ void msg_delete(httpmsg_t *msg,
 char *msg_header_value(const httpmsg_t *msg,
                        char *key)
 {
+  if (msg->fields) {
+    int id = httpheader_id(key, strlen(key));
+    if (id != HDR_UNKNOWN) return msg_field_value(msg, id);
+
+    /* not a known header, search the whole table */
+    int i;
+    for (i = 0; i < msg->nfields; i++) {
+      if (strcasecmp(msg->fields[i].name, key) == 0)
+        return msg->fields[i].value;
+    }
+    return NULL;
+  }
+
   httpheader_t _h;
   _h.kvpair = key;
   httpheader_t *h = sll_search(msg->headers, &_h);
@@ -64,6 +117,15 @@ char *msg_header_value(const httpmsg_t *msg,
   return h->value;
 }
 
+/* request header by HDR_xxx, no string compare */
+char *msg_field_value(const httpmsg_t *msg,
+                      const int id)
+{
+  int i = msg->known[id];
+  if (i < 0) return NULL;
+  return msg->fields[i].value;
+}
+
 int msg_parse(sllist_t *headers,
               unsigned char **startline,
               unsigned char **body,
@@ -129,6 +191,26 @@ int msg_parse(sllist_t *headers,
   return i;
 }
 
+int msg_add_field(httpmsg_t *msg,
+                  char *name,
+                  const int len_name,
+                  char *value,
+                  const int len_value)
+{
+  if (msg->nfields == MAX_REQ_FIELDS) return -1;
+
+  /* the first occurrence of a known header is the one looked up */
+  int id = httpheader_id(name, len_name);
+  if (id != HDR_UNKNOWN && msg->known[id] < 0) msg->known[id] = msg->nfields;
+
+  httpfield_t *f = &msg->fields[msg->nfields++];
+  f->name = name;
+  f->len_name = len_name;
+  f->value = value;
+  f->len_value = len_value;
+  return 0;
+}
+
 void msg_add_header(httpmsg_t *msg,
                     const char *key,
                     const char *value)
@@ -168,7 +250,8 @@ int msg_headers_len(const httpmsg_t *msg)
 /*------------------------- request header -----------------------------------*/
 void msg_set_req_line(httpmsg_t *msg,
                       const char *method,
-                      const char *path,
+                      char *path,
+                      const int len_path,
                       const int major,
                       const int minor)
 {
@@ -188,11 +271,10 @@ void msg_set_req_line(httpmsg_t *msg,
   }
   total += len;
 
-  len = strlen(path);
-  msg->path = xmalloc(len + 1);
-  memcpy_fast(msg->path, path, len);
-  msg->path[len] = '\0';
-  total += len;
+  /* no copy, the path lives as long as the buffer it points into */
+  msg->path = path;
+  msg->len_path = len_path;
+  total += len_path;
 
   msg->ver_major = major;
   msg->ver_minor = minor;
@@ -223,13 +305,14 @@ void msg_req_headers(char *headerbytes,
   *ret++ = LF;
 
   /* headers */
-  slnode_t *n = req->headers->head;
-  while (n != NULL) {
-    httpheader_t *h = (httpheader_t *)n->data;
-    ret = strbld(ret, h->kvpair);
+  int i;
+  for (i = 0; i < req->nfields; i++) {
+    ret = strbld(ret, req->fields[i].name);
+    *ret++ = ':';
+    *ret++ = ' ';
+    ret = strbld(ret, req->fields[i].value);
     *ret++ = CR;
     *ret++ = LF;
-    n = n->next;
   }
   /* ending CRLF */
   *ret++ = CR;
@@ -295,9 +378,11 @@ void msg_rep_headers(char *headerbytes,
 
 /*---------------------------- message body ----------------------------------*/
 void msg_set_body_start(httpmsg_t *msg,
-                        unsigned char *s)
+                        unsigned char *s,
+                        const size_t len)
 {
   msg->body_s = s;
+  msg->len_body_s = len;
 }
 
 void msg_add_body(httpmsg_t *msg,
@@ -318,45 +403,131 @@ void msg_add_zipped_body(httpmsg_t *msg,
 
 
 /*---------------------- message send ----------------------------------------*/
-void msg_send_headers(const int sockfd,
-                      const httpmsg_t *msg)
+/* start line + headers, the caller frees the returned bytes if *rendered */
+static char *_head_bytes(const httpmsg_t *msg,
+                         int *len,
+                         int *rendered)
 {
-  int len_headers = msg_headers_len(msg);
-  char *headerbytes = xmalloc(len_headers);
+  if (msg->head) {
+    *len = msg->len_head;
+    *rendered = 0;
+    return msg->head;
+  }
+
+  *len = msg_headers_len(msg);
+  *rendered = 1;
+  char *headerbytes = xmalloc(*len);
   msg_rep_headers(headerbytes, msg);
+  return headerbytes;
+}
+
+/* headers and body leave in a single sendmsg() */
+void msg_send(ioqueue_t *q,
+              const httpmsg_t *msg,
+              const unsigned char *body,
+              const size_t len_body)
+{
+  int len_head, rendered;
+  char *head = _head_bytes(msg, &len_head, &rendered);
+
+  struct iovec iov[2];
+  iov[0].iov_base = head;
+  iov[0].iov_len = len_head;
+  iov[1].iov_base = (void *)body;
+  iov[1].iov_len = len_body;
+
+  D_PRINT("[MSG] Sending msg headers and body... %d\n", q->sockfd);
+  ioqueue_writev(q, iov, len_body ? 2 : 1, 0);
+  if (rendered) xfree(head);
+}
+
+/* headers and the whole body as a single chunk, terminating chunk included */
+void msg_send_chunked(ioqueue_t *q,
+                      const httpmsg_t *msg,
+                      const char *chunk,
+                      const int len_chunk)
+{
+  int len_head, rendered;
+  char *head = _head_bytes(msg, &len_head, &rendered);
+
+  /* xxxx\r\n - length in Hex */
+  unsigned char hex_len[16];
+  int len = itos(hex_len, len_chunk, 16, ' ');
+  hex_len[len++] = CR;
+  hex_len[len++] = LF;
+
+  struct iovec iov[4];
+  iov[0].iov_base = head;
+  iov[0].iov_len = len_head;
+  iov[1].iov_base = hex_len;
+  iov[1].iov_len = len;
+  iov[2].iov_base = (void *)chunk;
+  iov[2].iov_len = len_chunk;
+  iov[3].iov_base = "\r\n0\r\n\r\n";
+  iov[3].iov_len = 7;
+
+  D_PRINT("[MSG] Sending msg headers and chunk... %d\n", q->sockfd);
+  ioqueue_writev(q, iov, 4, 0);
+  if (rendered) xfree(head);
+}
+
+/* the body follows, MSG_MORE lets the kernel merge them into full frames */
+void msg_send_headers(ioqueue_t *q,
+                      const httpmsg_t *msg)
+{
+  int len_head, rendered;
+  char *head = _head_bytes(msg, &len_head, &rendered);
+
+  struct iovec iov;
+  iov.iov_base = head;
+  iov.iov_len = len_head;
 
   /* send header */
-  D_PRINT("[MSG] Sending msg headers... %d\n", sockfd);
-  io_socket_write(sockfd, (unsigned char *)headerbytes, len_headers);
-  xfree(headerbytes);
+  D_PRINT("[MSG] Sending msg headers... %d\n", q->sockfd);
+  ioqueue_writev(q, &iov, 1, MSG_MORE);
+  if (rendered) xfree(head);
 }
 
-void msg_send_body(const int sockfd,
+void msg_send_body(ioqueue_t *q,
                    const unsigned char *data,
                    const int len_data)
 {
-  io_socket_write(sockfd, data, len_data);
+  struct iovec iov;
+  iov.iov_base = (void *)data;
+  iov.iov_len = len_data;
+  ioqueue_writev(q, &iov, 1, 0);
 }
 
-void msg_send_body_chunk(const int sockfd,
+void msg_send_body_chunk(ioqueue_t *q,
                          const char *chunk,
                          const int len_chunk)
 {
+  /* xxxx\r\n - chunked length in Hex */
   unsigned char hex_len[16];
   int len = itos(hex_len, len_chunk, 16, ' ');
-  /* chunked length in Hex */
-  D_PRINT("[MSG] Sending the chunk length on socket %d\n", sockfd);
-  io_socket_write(sockfd, hex_len, len);
-  io_socket_write(sockfd, (unsigned char *)"\r\n", 2);
-  /* chunk */
-  D_PRINT("[MSG] Sending the chunk on socket %d\n", sockfd);
-  io_socket_write(sockfd, (unsigned char *)chunk, len_chunk);
-  io_socket_write(sockfd, (unsigned char *)"\r\n", 2);
+  hex_len[len++] = CR;
+  hex_len[len++] = LF;
+
+  struct iovec iov[3];
+  iov[0].iov_base = hex_len;
+  iov[0].iov_len = len;
+  iov[1].iov_base = (void *)chunk;
+  iov[1].iov_len = len_chunk;
+  iov[2].iov_base = "\r\n";
+  iov[2].iov_len = 2;
+
+  /* another chunk or the terminating one follows */
+  D_PRINT("[MSG] Sending the chunk on socket %d\n", q->sockfd);
+  ioqueue_writev(q, iov, 3, MSG_MORE);
 }
 
-void msg_send_body_end_chunk(const int sockfd)
+void msg_send_body_end_chunk(ioqueue_t *q)
 {
+  struct iovec iov;
+  iov.iov_base = "0\r\n\r\n";
+  iov.iov_len = 5;
+
   /* terminating the chuncked transfer */
-  D_PRINT("[MSG] Sending the terminating chunk on socket %d\n", sockfd);
-  io_socket_write(sockfd, (unsigned char *)"0\r\n\r\n", 5);
+  D_PRINT("[MSG] Sending the terminating chunk on socket %d\n", q->sockfd);
+  ioqueue_writev(q, &iov, 1, 0);
 }
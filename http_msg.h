@@ -11,35 +11,52 @@
 #define METHOD_GET 1
 #define METHOD_POST 2
 
+#define MAX_REQ_FIELDS 64
+
 
 typedef struct {
   int method;
   char *path;
+  int len_path;
   int ver_major;
   int ver_minor;
   int code;      /* status code */
   char *status;  /* status text */
 
-  sllist_t *headers;
+  sllist_t *headers;    /* response headers */
+  httpfield_t *fields;  /* request headers, slices of the receive buffer */
+  int nfields;
+  short known[HDR_KNOWN];  /* HDR_xxx -> index in fields, -1 if absent */
 
   int len_startline;
   int len_headers;
 
+  char *head;    /* start line + headers already rendered, or NULL */
+  int len_head;
+
   unsigned char *body;    /* point to the body, raw or compressed */
   unsigned char *body_zipped;
   unsigned char *body_s;  /* point to the range start of the body */
+  size_t len_body_s;      /* bytes to send from body_s */
+  int fd;                 /* or from this file at off, -1 if none */
+  off_t off;
   size_t len_body;
 } httpmsg_t;
 
 
 httpmsg_t *msg_new();
 
+httpmsg_t *msg_new_req();
+
 void msg_delete(httpmsg_t *msg,
                 const int delbody);
 
 char *msg_header_value(const httpmsg_t *msg,
                        char *key);
 
+char *msg_field_value(const httpmsg_t *msg,
+                      const int id);
+
 int msg_parse(sllist_t *headers,
               unsigned char **startline,
               unsigned char **body,
@@ -55,10 +72,17 @@ int msg_headers_len(const httpmsg_t *msg);
 /*------------------------- request header -----------------------------------*/
 void msg_set_req_line(httpmsg_t *msg,
                       const char *method,
-                      const char *path,
+                      char *path,
+                      const int len_path,
                       const int major,
                       const int minor);
 
+int msg_add_field(httpmsg_t *msg,
+                  char *name,
+                  const int len_name,
+                  char *value,
+                  const int len_value);
+
 void msg_req_headers(char *headerbytes,
                      const httpmsg_t *req);
 
@@ -74,7 +98,8 @@ void msg_rep_headers(char *headerbytes,
 
 /*---------------------------- message body ----------------------------------*/
 void msg_set_body_start(httpmsg_t *msg,
-                        unsigned char *s);
+                        unsigned char *s,
+                        const size_t len);
 
 void msg_add_body(httpmsg_t *msg,
                   unsigned char *body,
@@ -85,18 +110,28 @@ void msg_add_zipped_body(httpmsg_t *msg,
                          const size_t len);
 
 /*---------------------- message send ----------------------------------------*/
-void msg_send_headers(const int sockfd,
+void msg_send(ioqueue_t *q,
+              const httpmsg_t *msg,
+              const unsigned char *body,
+              const size_t len_body);
+
+void msg_send_chunked(ioqueue_t *q,
+                      const httpmsg_t *msg,
+                      const char *chunk,
+                      const int len_chunk);
+
+void msg_send_headers(ioqueue_t *q,
                       const httpmsg_t *msg);
 
-void msg_send_body(const int sockfd,
+void msg_send_body(ioqueue_t *q,
                    const unsigned char *data,
                    const int len_data);
 
-void msg_send_body_chunk(const int sockfd,
+void msg_send_body_chunk(ioqueue_t *q,
                          const char *chunk,
                          const int len_chunk);
 
-void msg_send_body_end_chunk(const int sockfd);
+void msg_send_body_end_chunk(ioqueue_t *q);
 
 
 #endif
@@ -4,8 +4,14 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+#include <sys/uio.h>
 #include "xmalloc.h"
 #include "sllist.h"
+#include "util.h"
+#include "scan_simd.h"
+#include "io.h"
+#include "http_header.h"
 #include "http_msg.h"
 #include "http_parser.h"
 
@@ -13,34 +19,191 @@
 #include "debug.h"
 
 
-httpmsg_t *http_parse_req(const unsigned char *buf)
+#define LF '\n'
+#define CR '\r'
+
+#define MAX_HEAD_SIZE 16384  /* start line + headers */
+
+
+void http_parser_init(httpparser_t *p,
+                      const size_t max_body)
 {
-  unsigned char *startline;
-  httpmsg_t *req = msg_new();
-  int n = msg_parse(req->headers, &startline, &req->body, &req->len_body, buf);
-  D_PRINT("[PARSER] number of headers (include startline) = %d\n", n);
-  if (n < 3) {
-    D_PRINT("[PARSER] not a valid message\n");
-    msg_delete(req, 1);
-    return NULL;
-  }
+  p->state = PARSER_STARTLINE;
+  p->line = 0;
+  p->pos = 0;
+  p->len_head = 0;
+  p->len_body = 0;
+  p->max_body = max_body;
+  p->msg = NULL;
+}
 
-  /* request line ... */
-  D_PRINT("[PARSER] startline: %s\n", startline);
-  char *rest = (char *)startline;
-  char *method = strtok_r(rest, " ", &rest);
-  char *path = strtok_r(NULL, " ", &rest);
-  char *version = strtok_r(NULL, " ", &rest);
+void http_parser_reset(httpparser_t *p)
+{
+  if (p->msg) msg_delete(p->msg, 0);
+  http_parser_init(p, p->max_body);
+}
+
+/* the request line is split in place, the spaces and the line end are
+ * overwritten with '\0' so method, path and version are C strings */
+static int _parse_startline(httpmsg_t *req,
+                            unsigned char *s,
+                            const size_t len)
+{
+  s[len] = '\0';
+  D_PRINT("[PARSER] startline: %s\n", s);
+
+  /*  GET /xxxxxxxxxxxx HTTP/1.1\0
+   *  ^   ^             ^        ^
+   *  s   sp1           sp2      end */
+  unsigned char *end = s + len;
+  unsigned char *sp1 = scan_chr(s, end, ' ');
+  if (sp1 == NULL) return PARSER_ERROR;
+  unsigned char *sp2 = scan_chr(sp1 + 1, end, ' ');
+  if (sp2 == NULL) return PARSER_ERROR;
+  *sp1 = '\0';
+  *sp2 = '\0';
+
+  char *method = (char *)s;
+  char *path = (char *)sp1 + 1;
+  char *version = (char *)sp2 + 1;
+  if (*path == '\0' || end - sp2 - 1 != 8 ||
+      strncmp(version, "HTTP/", 5) != 0 ||
+      (strcmp(method, "GET") != 0 && strcmp(method, "HEAD") != 0 &&
+       strcmp(method, "POST") != 0))
+    return PARSER_ERROR;
   int major = version[5] - '0';
   int minor = version[7] - '0';
 
   if (strcmp(path, "/") == 0)
-    msg_set_req_line(req, method, "/demo/index.html", major, minor);
+    msg_set_req_line(req, method, "/demo/index.html", 16, major, minor);
   else
-    msg_set_req_line(req, method, path, major, minor);
+    msg_set_req_line(req, method, path, (char *)sp2 - path, major, minor);
+  return PARSER_AGAIN;
+}
 
-  xfree(startline);
-  return req;
+/* name: value, the ':' and the line end are overwritten with '\0' */
+static int _parse_header(httpmsg_t *req,
+                         unsigned char *s,
+                         const size_t len)
+{
+  unsigned char *end = s + len;
+  unsigned char *colon = scan_chr(s, end, ':');
+  if (colon == NULL || colon == s) return PARSER_ERROR;
+
+  unsigned char *v = colon + 1;
+  while (v < end && (*v == ' ' || *v == '\t')) v++;
+  while (end > v && (end[-1] == ' ' || end[-1] == '\t')) end--;
+  *colon = '\0';
+  *end = '\0';
+
+  D_PRINT("[PARSER] k = %s value = %s\n", s, v);
+  if (msg_add_field(req, (char *)s, colon - s, (char *)v, end - v) == -1)
+    return PARSER_ERROR;
+  return PARSER_AGAIN;
+}
+
+static char *_rebase(char *ptr,
+                     const unsigned char *from,
+                     unsigned char *to,
+                     const size_t len)
+{
+  uintptr_t off = (uintptr_t)ptr - (uintptr_t)from;
+  /* e.g. the default path doesn't point into the buffer */
+  if (off >= len) return ptr;
+  return (char *)to + off;
+}
+
+/* the receive buffer has been moved by realloc(),
+ * make the slices of the request point into the new one */
+void http_parser_rebase(httpparser_t *p,
+                        const unsigned char *from,
+                        unsigned char *to,
+                        const size_t len)
+{
+  httpmsg_t *req = p->msg;
+  if (req == NULL || from == to) return;
+
+  req->path = _rebase(req->path, from, to, len);
+  int i;
+  for (i = 0; i < req->nfields; i++) {
+    req->fields[i].name = _rebase(req->fields[i].name, from, to, len);
+    req->fields[i].value = _rebase(req->fields[i].value, from, to, len);
+  }
+}
+
+static int _parse_body_len(httpparser_t *p)
+{
+  char *te = msg_field_value(p->msg, HDR_TRANSFER_ENCODING);
+  if (te) {
+    D_PRINT("[PARSER] chunked request body not supported\n");
+    return PARSER_ERROR;
+  }
+
+  p->len_body = 0;
+  char *cl = msg_field_value(p->msg, HDR_CONTENT_LENGTH);
+  if (cl) {
+    char *end;
+    p->len_body = strtoul(cl, &end, 10);
+    if (end == cl || p->len_body > p->max_body) {
+      D_PRINT("[PARSER] bad Content-Length: %s\n", cl);
+      return PARSER_ERROR;
+    }
+  }
+  return PARSER_AGAIN;
+}
+
+/* consumes the bytes received so far and resumes where the previous call
+ * stopped, buf always starts at the first byte of the request */
+int http_parse_req(httpparser_t *p,
+                   unsigned char *buf,
+                   const size_t len)
+{
+  if (p->msg == NULL) p->msg = msg_new_req();
+
+  while (p->state != PARSER_BODY) {
+    unsigned char *lf = scan_chr(buf + p->pos, buf + len, LF);
+    if (lf == NULL) {
+      p->pos = len;
+      return len > MAX_HEAD_SIZE ? PARSER_ERROR : PARSER_AGAIN;
+    }
+
+    /*  xxxxxxxxxxxxxxxxxxxxxxxxxxxxx\r\n
+     *  ^                              ^
+     *  line                           lf */
+    unsigned char *s = buf + p->line;
+    size_t size = lf - s;
+    if (size && s[size - 1] == CR) size--;
+    p->line = lf - buf + 1;
+    p->pos = p->line;
+    if (p->line > MAX_HEAD_SIZE) return PARSER_ERROR;
+
+    if (p->state == PARSER_STARTLINE) {
+      /* ignore the empty lines before the request line */
+      if (size == 0) continue;
+      if (_parse_startline(p->msg, s, size) == PARSER_ERROR)
+        return PARSER_ERROR;
+      p->state = PARSER_HEADERS;
+    }
+    else if (size) {
+      if (_parse_header(p->msg, s, size) == PARSER_ERROR)
+        return PARSER_ERROR;
+    }
+    else {  /* end of headers */
+      p->len_head = p->line;
+      if (_parse_body_len(p) == PARSER_ERROR) return PARSER_ERROR;
+      p->state = PARSER_BODY;
+    }
+  }
+
+  /* body */
+  if (len - p->len_head < p->len_body) return PARSER_AGAIN;
+  if (p->len_body) {
+    p->msg->body = buf + p->len_head;
+    p->msg->len_body = p->len_body;
+  }
+  D_PRINT("[PARSER] request parsed, head %ld, body %ld\n",
+          p->len_head, p->len_body);
+  return PARSER_DONE;
 }
 
 httpmsg_t *http_parse_rep(const unsigned char *buf)
@@ -8,7 +8,44 @@
 #define _HTTP_PARSER_H_
 
 
-httpmsg_t *http_parse_req(const unsigned char *buf);
+/* return values of http_parse_req() */
+#define PARSER_ERROR -1
+#define PARSER_AGAIN 0  /* need more bytes */
+#define PARSER_DONE 1
+
+/* parser states */
+#define PARSER_STARTLINE 0
+#define PARSER_HEADERS 1
+#define PARSER_BODY 2
+
+
+/* the parser keeps offsets, not pointers, so the receive buffer
+ * can be grown between two calls */
+typedef struct {
+  int state;
+  size_t line;      /* start of the line being parsed */
+  size_t pos;       /* bytes already scanned */
+  size_t len_head;  /* start line + headers + the empty line */
+  size_t len_body;  /* Content-Length */
+  size_t max_body;
+  httpmsg_t *msg;   /* request being built */
+} httpparser_t;
+
+
+void http_parser_init(httpparser_t *p,
+                      const size_t max_body);
+
+void http_parser_reset(httpparser_t *p);
+
+void http_parser_rebase(httpparser_t *p,
+                        const unsigned char *from,
+                        unsigned char *to,
+                        const size_t len);
+
+int http_parse_req(httpparser_t *p,
+                   unsigned char *buf,
+                   const size_t len);
+
 httpmsg_t *http_parse_rep(const unsigned char *buf);
 
 
@@ -5,11 +5,16 @@
 #include <stdlib.h>
 #include <errno.h>
 #include <time.h>
+#include <pthread.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/uio.h>
 #include <libpq-fe.h>
 #include <libdeflate.h>
 #include "xmalloc.h"
 #include "util.h"
 #include "sllist.h"
+#include "thpool.h"
 #include "rbtree.h"
 #include "json.h"
 #include "jwt.h"
@@ -17,7 +22,10 @@
 #include "pg_conn.h"
 #include "sqlobj.h"
 #include "sqlops.h"
+#include "io.h"
+#include "http_header.h"
 #include "http_msg.h"
+#include "http_cache.h"
 #include "http_cfg.h"
 #include "http_method.h"
 
@@ -37,7 +45,7 @@ static void _add_common_headers(httpmsg_t *rep)
   msg_add_header(rep, "Date", rep_date);
 }
 
-static void _wrong_user_pass(const int sockfd)
+static void _wrong_user_pass(ioqueue_t *wq)
 {
   httpmsg_t *rep = msg_new();
   msg_set_rep_line(rep, 1, 1, 200, "OK");
@@ -45,20 +53,188 @@ static void _wrong_user_pass(const int sockfd)
   msg_add_header(rep, "Content-Type", "text/plain");
   msg_add_header(rep, "Content-Length", "20");
 
-  msg_send_headers(sockfd, rep);
-  msg_send_body(sockfd, (unsigned char *)"Wrong user/password!", 20);
+  msg_send(wq, rep, (unsigned char *)"Wrong user/password!", 20);
   msg_delete(rep, 0);
 }
 
-static void _svc_dispatch(const int sockfd,
-                          PGconn *pgconn,
+static void _sql_error(ioqueue_t *wq,
+                       const int code,
+                       const char *reason)
+{
+  char *body = "{\"error\":\"database\"}";
+  char len[8];
+  sprintf(len, "%lu", strlen(body));
+
+  httpmsg_t *rep = msg_new();
+  msg_set_rep_line(rep, 1, 1, code, reason);
+  _add_common_headers(rep);
+  msg_add_header(rep, "Content-Type", "application/json");
+  msg_add_header(rep, "Content-Length", len);
+
+  msg_send(wq, rep, (unsigned char *)body, strlen(body));
+  msg_delete(rep, 0);
+}
+
+typedef struct {
+  pgpool_t *pgpool;
+  sqlobj_t *sqlo;
+  httpjob_t *job;
+  sqlfetch_t fetch;
+  int started;              /* the headers are sent */
+} sqljob_t;
+
+static void _sql_free(sqljob_t *j)
+{
+  sql_fetch_clear(&j->fetch);
+  sqlobj_destroy(j->sqlo);
+  xfree(j);
+}
+
+static httpmsg_t *_sql_rep_msg()
+{
+  httpmsg_t *rep = msg_new();
+  msg_set_rep_line(rep, 1, 1, 200, "OK");
+  _add_common_headers(rep);
+  msg_add_header(rep, "Content-Type", "application/json");
+  msg_add_header(rep, "Transfer-Encoding", "chunked");
+  return rep;
+}
+
+static void _sql_chunk(ioqueue_t *wq,
+                       sqljob_t *j)
+{
+  if (!j->started) {
+    httpmsg_t *rep = _sql_rep_msg();
+    msg_send_headers(wq, rep);
+    msg_delete(rep, 0);
+    j->started = 1;
+  }
+  msg_send_body_chunk(wq, j->fetch.buf, j->fetch.len);
+  j->fetch.len = 0;
+}
+
+/* return - 0: replied, -1: the reply is cut */
+static int _sql_end(ioqueue_t *wq,
+                    sqljob_t *j,
+                    const int rc)
+{
+  pgpool_return(j->pgpool, j->fetch.pc);
+  if (rc == -1) {
+    /* the status line has gone with the first chunk */
+    if (j->started) {
+      _sql_free(j);
+      return -1;
+    }
+    _sql_error(wq, 500, "Internal Server Error");
+  }
+  else if (!j->started) {
+    /* a small result set leaves with the headers */
+    httpmsg_t *rep = _sql_rep_msg();
+    msg_send_chunked(wq, rep, j->fetch.buf, j->fetch.len);
+    msg_delete(rep, 0);
+  }
+  else {
+    _sql_chunk(wq, j);
+    msg_send_body_end_chunk(wq);
+  }
+  _sql_free(j);
+  return 0;
+}
+
+/* the connection watches the socket of the database for the pipeline,
+ * no thread waits for the server; the job stops at each chunk the client
+ * doesn't take at once, the memory of a result set stays bounded */
+static int _sql_poll(ioqueue_t *wq,
+                     void *arg)
+{
+  sqljob_t *j = (sqljob_t *)arg;
+  for (;;) {
+    int rc = sql_fetch_poll(&j->fetch);
+    if (rc == SQL_READ) return EPOLLIN;
+    if (rc == SQL_WRITE) return EPOLLOUT;
+    if (rc != SQL_CHUNK) return _sql_end(wq, j, rc);
+
+    _sql_chunk(wq, j);
+    if (wq->head) return EPOLLIN;
+  }
+}
+
+static void _sql_abort(void *arg)
+{
+  sqljob_t *j = (sqljob_t *)arg;
+  /* left halfway, dropped by the pool */
+  pgpool_return(j->pgpool, j->fetch.pc);
+  _sql_free(j);
+}
+
+/* return - 1: the pipeline is sent, poll it, 0: replied */
+static int _sql_start(ioqueue_t *wq,
+                      sqljob_t *j,
+                      pgconn_t *pc)
+{
+  if (pc == NULL) {
+    _sql_error(wq, 503, "Service Unavailable");
+    _sql_free(j);
+    return 0;
+  }
+  if (sql_fetch_send(&j->fetch, pc, j->sqlo) == -1) {
+    pgpool_return(j->pgpool, pc);
+    _sql_error(wq, 500, "Internal Server Error");
+    _sql_free(j);
+    return 0;
+  }
+  if (j->job) {
+    j->job->poll = _sql_poll;
+    j->job->abort = _sql_abort;
+    j->job->fd = PQsocket(pc->conn);
+    j->job->arg = j;
+  }
+  return 1;
+}
+
+/* on the I/O pool, waiting for (or opening) a connection blocks, the
+ * query goes on as a poll job */
+static void _sql_job(ioqueue_t *wq,
+                     void *arg)
+{
+  sqljob_t *j = (sqljob_t *)arg;
+  _sql_start(wq, j, pgpool_lease(j->pgpool));
+}
+
+/* no I/O pool, the thread waits for the database, the chunks are queued
+ * whether the client takes them or not */
+static void _sql_rep(ioqueue_t *wq,
+                     sqljob_t *j)
+{
+  if (!_sql_start(wq, j, pgpool_lease(j->pgpool))) return;
+
+  struct pollfd pfd;
+  pfd.fd = PQsocket(j->fetch.pc->conn);
+  for (;;) {
+    int rc = sql_fetch_poll(&j->fetch);
+    if (rc == SQL_CHUNK) {
+      _sql_chunk(wq, j);
+      continue;
+    }
+    if (rc != SQL_READ && rc != SQL_WRITE) {
+      _sql_end(wq, j, rc);
+      return;
+    }
+    pfd.events = rc == SQL_READ ? POLLIN : POLLOUT;
+    poll(&pfd, 1, -1);
+  }
+}
+
+static void _svc_dispatch(ioqueue_t *wq,
+                          pgpool_t *pgpool,
                           rbtree_t *authdb,
                           const httpcfg_t *cfg,
-                          const httpmsg_t *req)
+                          const httpmsg_t *req,
+                          httpjob_t *job)
 {
   unsigned char *body = req->body;
   if (!body) return;
-  D_PRINT("[REQ] json string:\n%s\n", (char *)body);
+  D_PRINT("[REQ] json string:\n%.*s\n", (int)req->len_body, (char *)body);
 
   struct json_value_s *root = json_parse(body, req->len_body);
   struct json_object_s *object = json_value_as_object(root);
@@ -71,21 +247,27 @@ static void _svc_dispatch(const int sockfd,
     sqlobj_t *sqlo = sql_parse_json(e0);
     xfree(root);
 
-    char sqlres[2048];
-    sql_fetch(sqlres, pgconn, sqlo);
-    sqlobj_destroy(sqlo);
-
-    httpmsg_t *rep = msg_new();
-    msg_set_rep_line(rep, 1, 1, 200, "OK");
-    _add_common_headers(rep);
-    msg_add_header(rep, "Content-Type", "application/json");
-    msg_add_header(rep, "Transfer-Encoding", "chunked");
-
-    msg_send_headers(sockfd, rep);
-    msg_send_body_chunk(sockfd, sqlres, strlen(sqlres));
-    msg_send_body_end_chunk(sockfd);
+    sqljob_t *j = xmalloc(sizeof(sqljob_t));
+    j->pgpool = pgpool;
+    j->sqlo = sqlo;
+    j->job = job;
+    j->fetch.buf = NULL;
+    j->fetch.types = NULL;
+    j->started = 0;
 
-    msg_delete(rep, 0);
+    if (job) {
+      /* an idle connection takes the query right away */
+      pgconn_t *pc = pgpool_trylease(pgpool);
+      if (pc)
+        _sql_start(wq, j, pc);
+      else {
+        job->routine = _sql_job;
+        job->arg = j;
+      }
+    }
+    else
+      _sql_rep(wq, j);
+    return;
   }
 
   if (strcmp(key, "Auth") == 0) {
@@ -104,14 +286,13 @@ static void _svc_dispatch(const int sockfd,
       D_PRINT("[AUTH] id = %s, pass = %s\n", user->id, user->pass);
       if (strcmp(user->pass, pass) != 0) {
         xfree(root);
-        _wrong_user_pass(sockfd);
+        _wrong_user_pass(wq);
         return;
       }
-      xfree(root);
     }
     else {
       xfree(root);
-      _wrong_user_pass(sockfd);
+      _wrong_user_pass(wq);
       return;
     }
 
@@ -134,8 +315,7 @@ static void _svc_dispatch(const int sockfd,
     msg_add_header(rep, "Set-Cookie", cookie);
     D_PRINT("[JWT] %s\n", cookie);
 
-    msg_send_headers(sockfd, rep);
-    msg_send_body(sockfd, (unsigned char *)"You'v been authorized now!", 26);
+    msg_send(wq, rep, (unsigned char *)"You'v been authorized now!", 26);
 
     msg_delete(rep, 0);
   }
@@ -143,14 +323,15 @@ static void _svc_dispatch(const int sockfd,
   xfree(root);
 }
 
-void http_post(const int sockfd,
-               PGconn *pgconn,
+void http_post(ioqueue_t *wq,
+               pgpool_t *pgpool,
                rbtree_t *authdb,
                const httpcfg_t *cfg,
-               const httpmsg_t *req)
+               const httpmsg_t *req,
+               httpjob_t *job)
 {
-  char *ctype = msg_header_value(req, "Content-Type");
-  if (strcmp(ctype, "application/json") == 0) {
-    _svc_dispatch(sockfd, pgconn, authdb, cfg, req);
+  char *ctype = msg_field_value(req, HDR_CONTENT_TYPE);
+  if (ctype && strcmp(ctype, "application/json") == 0) {
+    _svc_dispatch(wq, pgpool, authdb, cfg, req, job);
   }
 }
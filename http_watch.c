@@ -0,0 +1,224 @@
+/* license: MIT license
+ * Copyright (C) 2021  Edward LEI <edward_lei72@hotmail.com> */
+
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include "xmalloc.h"
+#include "rbtree.h"
+#include "http_cache.h"
+#include "http_watch.h"
+
+#define DEBUG
+#include "debug.h"
+
+
+static void _set_dir(watch_t *w,
+                     const int wd,
+                     const char *dir)
+{
+  if (wd >= w->ndirs) {
+    int n = w->ndirs;
+    w->ndirs = wd * 2 + 1;
+    w->dirs = xrealloc(w->dirs, w->ndirs * sizeof(char *));
+    memset(w->dirs + n, 0, (w->ndirs - n) * sizeof(char *));
+  }
+  /* the same directory watched again keeps its descriptor */
+  if (w->dirs[wd]) xfree(w->dirs[wd]);
+  w->dirs[wd] = xstrdup(dir);
+}
+
+/* dir - request path of the directory, "" for the docroot; a directory
+ * which can't be watched, or a symbolic link (its target isn't watched),
+ * puts the hits back on the stat() path */
+static void _watch_tree(watch_t *w,
+                        const char *dir)
+{
+  char ospath[PATH_MAX];
+  snprintf(ospath, PATH_MAX, "%s%s", w->root, dir);
+
+  int wd = inotify_add_watch(w->fd, ospath,
+                             WATCH_EVENTS | IN_ONLYDIR | IN_DONT_FOLLOW);
+  if (wd == -1) {
+    D_PRINT("[WATCH] can't watch %s\n", ospath);
+    w->cache->watched = 0;
+    return;
+  }
+  _set_dir(w, wd, dir);
+
+  DIR *d = opendir(ospath);
+  if (!d) return;
+
+  struct dirent *e;
+  while ((e = readdir(d))) {
+    if (strcmp(e->d_name, ".") == 0 || strcmp(e->d_name, "..") == 0)
+      continue;
+
+    int type = e->d_type;
+    if (type == DT_UNKNOWN) {
+      struct stat sb;
+      if (fstatat(dirfd(d), e->d_name, &sb, AT_SYMLINK_NOFOLLOW) == -1)
+        continue;
+      type = S_ISDIR(sb.st_mode) ? DT_DIR : S_ISLNK(sb.st_mode) ? DT_LNK : 0;
+    }
+    if (type == DT_LNK) {
+      D_PRINT("[WATCH] %s/%s is a link, hits are stat()ed\n", ospath,
+              e->d_name);
+      w->cache->watched = 0;
+    }
+    if (type != DT_DIR) continue;
+
+    char sub[PATH_MAX];
+    snprintf(sub, PATH_MAX, "%s/%s", dir, e->d_name);
+    _watch_tree(w, sub);
+  }
+  closedir(d);
+}
+
+/* the watches of a directory moved away, their paths are wrong now */
+static void _unwatch_tree(watch_t *w,
+                          const char *dir)
+{
+  size_t len = strlen(dir);
+  int wd;
+
+  for (wd = 0; wd < w->ndirs; wd++) {
+    char *p = w->dirs[wd];
+    if (p && strncmp(p, dir, len) == 0 && (p[len] == '\0' || p[len] == '/'))
+      /* IN_IGNORED follows */
+      inotify_rm_watch(w->fd, wd);
+  }
+}
+
+static void _event(watch_t *w,
+                   const struct inotify_event *ev)
+{
+  if (ev->mask & IN_Q_OVERFLOW) {
+    /* events were lost, none of the entries can be trusted */
+    D_PRINT("[WATCH] queue overflow, cache dropped\n");
+    cache_drop_prefix(w->cache, "");
+    return;
+  }
+  if (ev->wd < 0 || ev->wd >= w->ndirs || !w->dirs[ev->wd]) return;
+
+  char *dir = w->dirs[ev->wd];
+  if (ev->mask & IN_IGNORED) {
+    xfree(dir);
+    w->dirs[ev->wd] = NULL;
+    return;
+  }
+  if (ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF)) {
+    /* a subdirectory is handled by the event of its parent */
+    if (dir[0] == '\0') {
+      D_PRINT("[WATCH] the docroot is gone\n");
+      w->cache->watched = 0;
+      cache_drop_prefix(w->cache, "");
+    }
+    return;
+  }
+  /* the events of a watched directory itself */
+  if (ev->len == 0) return;
+
+  char path[PATH_MAX];
+  snprintf(path, PATH_MAX, "%s/%s", dir, ev->name);
+
+  if (ev->mask & IN_ISDIR) {
+    if (ev->mask & IN_MOVED_FROM) _unwatch_tree(w, path);
+    if (ev->mask & (IN_CREATE | IN_MOVED_TO)) _watch_tree(w, path);
+    /* the files under it are gone, or new and maybe cached before their
+     * directory was watched */
+    size_t len = strlen(path);
+    if (len + 1 < PATH_MAX) {
+      path[len] = '/';
+      path[len + 1] = '\0';
+      cache_drop_prefix(w->cache, path);
+    }
+    return;
+  }
+  cache_drop(w->cache, path);
+}
+
+static void *_watch_cb(void *arg)
+{
+  watch_t *w = (watch_t *)arg;
+  char buf[WATCH_BUF_SIZE]
+    __attribute__ ((aligned(__alignof__(struct inotify_event))));
+  struct pollfd pfd;
+  pfd.fd = w->fd;
+  pfd.events = POLLIN;
+
+  while (w->running) {
+    if (poll(&pfd, 1, WATCH_TIMEOUT) <= 0) continue;
+
+    ssize_t len = read(w->fd, buf, WATCH_BUF_SIZE);
+    if (len <= 0) continue;
+
+    char *p = buf;
+    while (p < buf + len) {
+      const struct inotify_event *ev = (const struct inotify_event *)p;
+      _event(w, ev);
+      p += sizeof(struct inotify_event) + ev->len;
+    }
+  }
+  D_PRINT("[WATCH] watcher stopped\n");
+  return NULL;
+}
+
+/* return NULL if inotify isn't available, the hits keep their stat() */
+watch_t *watch_new(cache_t *cache,
+                   const char *root)
+{
+  int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (fd == -1) {
+    perror("[WATCH] inotify_init1()");
+    return NULL;
+  }
+
+  watch_t *w = xmalloc(sizeof(watch_t));
+  w->cache = cache;
+  w->root = xstrdup(root);
+  w->fd = fd;
+  w->dirs = NULL;
+  w->ndirs = 0;
+
+  /* cleared by any directory which can't be watched */
+  cache->watched = 1;
+  _watch_tree(w, "");
+  D_PRINT("[WATCH] %s watched, hits %s\n", root,
+          cache->watched ? "skip stat()" : "are stat()ed");
+
+  w->running = 1;
+  if (pthread_create(&w->tid, NULL, _watch_cb, (void *)w) != 0) {
+    cache->watched = 0;
+    w->running = 0;
+    watch_delete(w);
+    return NULL;
+  }
+  return w;
+}
+
+void watch_delete(watch_t *w)
+{
+  if (!w) return;
+  if (w->running) {
+    w->running = 0;
+    pthread_join(w->tid, NULL);
+  }
+  w->cache->watched = 0;
+
+  int i;
+  for (i = 0; i < w->ndirs; i++) {
+    if (w->dirs[i]) xfree(w->dirs[i]);
+  }
+  if (w->dirs) xfree(w->dirs);
+  close(w->fd);
+  xfree(w->root);
+  xfree(w);
+}
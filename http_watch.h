@@ -0,0 +1,36 @@
+/* license: MIT license
+ * Copyright (C) 2021  Edward LEI <edward_lei72@hotmail.com> */
+
+#ifndef _HTTP_WATCH_H_
+#define _HTTP_WATCH_H_
+
+
+#define WATCH_TIMEOUT 500    /* ms, the watcher checks it still runs */
+#define WATCH_BUF_SIZE 16384 /* inotify events read at once */
+
+#define WATCH_EVENTS (IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB | \
+                      IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | \
+                      IN_DELETE_SELF | IN_MOVE_SELF)
+
+
+/* the docroot watched by inotify, a file which changes drops its entry
+ * from the cache; inotify isn't recursive, every directory has its own
+ * watch, the new ones are watched as they come */
+typedef struct {
+  cache_t *cache;
+  char *root;
+  int fd;                   /* inotify instance */
+  char **dirs;              /* request path of each watch descriptor */
+  int ndirs;
+  pthread_t tid;
+  volatile int running;
+} watch_t;
+
+
+watch_t *watch_new(cache_t *cache,
+                   const char *root);
+
+void watch_delete(watch_t *w);
+
+
+#endif
@@ -7,21 +7,32 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <time.h>
+#include <pthread.h>
 #include <sys/epoll.h>
 #include <sys/socket.h>
 #include <sys/sysinfo.h>
+#include <sys/uio.h>
 #include <libpq-fe.h>
 #include <libdeflate.h>
 #include "xmalloc.h"
 #include "rbtree.h"
+#include "twheel.h"
 #include "util.h"
 #include "auth.h"
 #include "thpool.h"
+#include "sllist.h"
+#include "io.h"
+#include "http_header.h"
+#include "http_msg.h"
+#include "http_parser.h"
 #include "http_cfg.h"
-#include "epsock.h"
 #include "pg_conn.h"
 #include "http_cache.h"
+#include "http_watch.h"
+#include "epsock.h"
+#include "http_method.h"
 #include "http_conn.h"
+#include "reactor.h"
 
 #define DEBUG
 #include "debug.h"
@@ -39,14 +50,54 @@ static void _svc_stopper(int dummy)
 }
 
 
+static void _usage(const char *prog)
+{
+  printf("usage: %s [-r reactors] [-s] [-c] [-m megabytes] [-w dir] "
+         "[-S file]\n", prog);
+  printf("  -r n  run n epoll reactors, each owning its connections\n");
+  printf("  -s    one SO_REUSEPORT listener per reactor\n");
+  printf("  -c    like -s, steer accepts to the reactor on the same cpu\n");
+  printf("  -m n  cache n MB of files at most (raw and compressed)\n");
+  printf("  -w d  cache the files under d (a request path) at the start\n");
+  printf("  -S f  save the cache to f at the exit, map it at the start\n");
+}
+
+
 int main(int argc, char **argv)
 {
   /* set the http configure */
   httpcfg_t *cfg = httpcfg_new();
 
-  /* create a postgresql db connection */
-  /* PGconn *pgconn = pg_connect("dbname = demo", "identity"); */
-  PGconn *pgconn = NULL;
+  int opt;
+  while ((opt = getopt(argc, argv, "r:m:w:S:sch")) != -1) {
+    switch (opt) {
+    case 'r':
+      cfg->reactors = atoi(optarg);
+      break;
+    case 'm':
+      cfg->cache_size = atol(optarg) * 1048576;
+      break;
+    case 'w':
+      cfg->warm_dir = xstrdup(optarg);
+      break;
+    case 'S':
+      cfg->snapshot = xstrdup(optarg);
+      break;
+    case 'c':
+      cfg->steer_cpu = 1;
+      /* fall through */
+    case 's':
+      cfg->reuseport = 1;
+      break;
+    default:
+      _usage(argv[0]);
+      httpcfg_delete(cfg);
+      return 0;
+    }
+  }
+
+  /* postgresql db connections, opened when the first queries come */
+  pgpool_t *pgpool = pgpool_new("dbname = demo", "identity", cfg->pg_conns);
   /* must called before calling libdeflate_alloc_compressor */
   libdeflate_set_memory_allocator(xmalloc, xfree);
 
@@ -71,15 +122,29 @@ int main(int argc, char **argv)
 
   /* detect number of cpu cores and use it for thread pool */
   int np = get_nprocs();
-  thpool_t *taskpool = thpool_new(np);
-
-  /* list of files cached in the memory */
-  rbtree_t *cache = rbtree_new(httpcache_compare,
-                               httpcache_delete,
-                               httpcache_print);
-  /* timers */
-  rbtree_t *timers = rbtree_new(httpconn_compare,
-                                httpconn_delete,
+  /* sharded listeners need the reactors to accept on */
+  if (cfg->reuseport && cfg->reactors <= 0) cfg->reactors = np;
+  /* the filter only picks the listeners of the cpus there are */
+  if (cfg->steer_cpu && cfg->reactors > np) {
+    printf("-c: the reactors limited to the %d cpus\n", np);
+    cfg->reactors = np;
+  }
+  thpool_t *taskpool = NULL;
+  if (cfg->reactors <= 0) taskpool = thpool_new(np);
+  /* blocking work (SQL, cold files) is sized apart from the network side,
+   * a slow query doesn't hold a worker serving the static files */
+  thpool_t *iopool = thpool_new(cfg->io_threads);
+
+  /* files cached in the memory, within cfg->cache_size bytes */
+  cache_t *cache = cache_new(cfg->cache_size);
+  /* the changed files leave the cache as they change */
+  watch_t *watch = watch_new(cache, cfg->docroot);
+  /* no cold start, the files are read while the server comes up */
+  http_get_warm(cache, cfg, iopool);
+  /* timers of the connections in the main epoll set,
+   * the reactors have their own */
+  twheel_t *timers = twheel_new(EPOLL_TIMEOUT,
+                                httpconn_timeout,
                                 httpconn_print);
 
   /* user database for authentication */
@@ -91,8 +156,42 @@ int main(int argc, char **argv)
   /* loop time */
   long loop_time = mstime();
 
-  /* listen on PORT */
-  int srvfd = epsock_listen(PORT);
+  /* listen on PORT, sharded listeners are owned by the reactors */
+  int srvfd = -1;
+  if (!cfg->reuseport) srvfd = epsock_listen(PORT);
+
+  /* n-reactor mode, each reactor owns an epoll set and its connections */
+  reactor_t **reactors = NULL;
+  int i;
+  if (cfg->reactors > 0) {
+    reactors = xcalloc(cfg->reactors, sizeof(reactor_t *));
+    for (i = 0; i < cfg->reactors; i++) {
+      reactors[i] = reactor_new(i);
+      if (reactors[i] == NULL) return -1;
+      /* the SYNs handled on cpu c go to the listener c % reactors */
+      if (cfg->steer_cpu) {
+        reactors[i]->cpu = i;
+        reactors[i]->cpu_step = cfg->reactors;
+      }
+      if (cfg->reuseport &&
+          reactor_listen(reactors[i], epsock_listen_reuseport(PORT),
+                         pgpool, cache, iopool, authdb, cfg) == -1)
+        return -1;
+    }
+    /* the listeners were bound in reactor order, so the index picked by
+     * the filter is the reactor pinned to the cpus of its SYNs */
+    if (cfg->steer_cpu)
+      epsock_steer_cpu(reactors[0]->srvconn->sockfd, cfg->reactors);
+    if (cfg->reuseport) printf("listening on port [%d]\n", PORT);
+
+    for (i = 0; i < cfg->reactors; i++) {
+      if (reactor_start(reactors[i]) == -1) {
+        D_PRINT("[REACTOR] failed to start reactor %d\n", i);
+        return -1;
+      }
+    }
+    D_PRINT("[REACTOR] %d reactors running\n", cfg->reactors);
+  }
 
   /* create the epoll socket */
   int epfd = epoll_create1(0);
@@ -102,13 +201,17 @@ int main(int argc, char **argv)
   }
 
   /* mark the server socket for reading, and become edge-triggered */
-  struct epoll_event event;
-  httpconn_t *srvconn = httpconn_new(srvfd, epfd, NULL, NULL, NULL, NULL, NULL);
-  event.data.ptr = (void *)srvconn;
-  event.events = EPOLLIN | EPOLLET;
-  if (epoll_ctl(epfd, EPOLL_CTL_ADD, srvfd, &event) == -1) {
-    perror("epoll_ctl()");
-    return -1;
+  httpconn_t *srvconn = NULL;
+  if (srvfd != -1) {
+    struct epoll_event event;
+    srvconn = httpconn_new(srvfd, epfd, NULL, NULL, NULL, NULL, NULL,
+                           NULL);
+    event.data.ptr = (void *)srvconn;
+    event.events = EPOLLIN | EPOLLET;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, srvfd, &event) == -1) {
+      perror("epoll_ctl()");
+      return -1;
+    }
   }
 
   struct epoll_event *events = xcalloc(MAXEVENTS, sizeof(struct epoll_event));
@@ -117,60 +220,76 @@ int main(int argc, char **argv)
     if (nevents == -1) {
       if (errno == EINTR) continue;
       perror("epoll_wait()");
-    }
-
-    if ((mstime() - loop_time) >= EPOLL_TIMEOUT) {
-      /* expire the timers */
-      thpool_add_task(taskpool, httpconn_expire, timers);
-      /* expire the cache */
-      thpool_add_task(taskpool, httpcache_expire, cache);
-      loop_time = mstime();
+      nevents = 0;
     }
 
     /* loop through events */
-    int i = 0;
-    do {
+    for (i = 0; i < nevents; i++) {
       httpconn_t *conn = (httpconn_t *)events[i].data.ptr;
-      /* error case */
-      if ((events[i].events & EPOLLERR) || (events[i].events & EPOLLHUP)) {
-        if (errno == EAGAIN || errno == EINTR)
-          nsleep(10);
-        else {
-          D_PRINT("[EPOLL] errno = %d, ", errno);
-          perror("[ERR|HUP]");
-          break;
-        }
+      if (conn->sockfd == srvfd) {
+        if (reactors)
+          reactor_connect(reactors, cfg->reactors, srvfd,
+                          pgpool, cache, iopool, authdb, cfg);
+        else
+          epsock_connect(srvfd, epfd, pgpool, cache, timers, iopool,
+                         authdb, cfg);
+        continue;
       }
-      /* get input */
-      if (events[i].events & EPOLLIN) {
-        if (conn->sockfd == srvfd)
-          epsock_connect(srvfd, epfd, pgconn, cache, timers, authdb, cfg);
-        else {
-          /* client socket; read client data and process it */
-          thpool_add_task(taskpool, httpconn_task, conn);
-        }
+      /* get input, or the socket takes the waiting replies again;
+       * EPOLLERR and EPOLLHUP also go through the read path,
+       * recv() reports the closed or broken connection */
+      if (events[i].events & (EPOLLIN | EPOLLOUT | EPOLLERR | EPOLLHUP)) {
+        /* the task owns a reference, the timeout can't free the
+         * connection under it */
+        httpconn_hold(conn);
+        thpool_add_task(taskpool, httpconn_task, conn);
       }
-      i++;
-    } while (i < nevents);
+    }
+
+    if ((mstime() - loop_time) >= EPOLL_TIMEOUT) {
+      /* expire the timers on this thread, after the events it received
+       * got their references */
+      httpconn_expire(timers);
+      /* expire the cache */
+      if (taskpool)
+        thpool_add_task(taskpool, cache_expire, cache);
+      else
+        cache_expire(cache);
+      loop_time = mstime();
+    }
   } while (svc_running);
 
   /* glibc doesn't free thread stacks when threads exit;
    * it caches them for reuse, and only prunes the cache when it gets huge.
    * Thus it always "leaks" some memory. So, don't worry about it. */
-  thpool_delete(taskpool);
+  if (taskpool) thpool_delete(taskpool);
+  if (reactors) {
+    for (i = 0; i < cfg->reactors; i++) reactor_stop(reactors[i]);
+  }
+  /* the jobs give their connections back */
+  thpool_delete(iopool);
 
-  rbtree_delete(timers);
-  rbtree_print(cache);
-  rbtree_delete(cache);
+  twheel_delete(timers);
+  watch_delete(watch);
+  if (cfg->snapshot) cache_save(cache, cfg->snapshot);
+  cache_print(cache);
+  cache_delete(cache);
   rbtree_delete(authdb);
 
-  shutdown(srvfd, SHUT_RDWR);
-  close(srvfd);
-  if (srvconn) xfree(srvconn);
+  if (reactors) {
+    for (i = 0; i < cfg->reactors; i++) reactor_delete(reactors[i]);
+    xfree(reactors);
+  }
+
+  if (srvconn) {
+    shutdown(srvfd, SHUT_RDWR);
+    close(srvfd);
+    xfree(srvconn);
+  }
   close(epfd);
   xfree(events);
 
-  /* PQfinish(pgconn); */
+  pgpool_delete(pgpool);
   httpcfg_delete(cfg);
 
   D_PRINT("Exit gracefully...\n");
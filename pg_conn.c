@@ -1,23 +1,25 @@
 /* license: MIT license
  * Copyright (C) 2021  Edward LEI <edward_lei72@hotmail.com> */
 
+#include <ctype.h>
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <poll.h>
+#include <pthread.h>
 #include <libpq-fe.h>
+#include "xmalloc.h"
 #include "util.h"
+#include "rbtree.h"
 #include "pg_conn.h"
 
 //#define DEBUG
 #include "debug.h"
 
 
-void pg_exit_nicely(PGconn *conn)
-{
-  PQfinish(conn);
-  exit(1);
-}
-
+/* return NULL if the database can't be reached */
 PGconn *pg_connect(const char *conninfo,
                    const char *schema)
 {
@@ -27,7 +29,8 @@ PGconn *pg_connect(const char *conninfo,
   /* Check to see that the backend connection was successfully made */
   if (PQstatus(conn) != CONNECTION_OK) {
     D_PRINT("[DB] Connection to database failed: %s\n", PQerrorMessage(conn));
-    pg_exit_nicely(conn);
+    PQfinish(conn);
+    return NULL;
   }
 
   /* Set always-secure search path, so malicious users can't take control */
@@ -40,7 +43,8 @@ PGconn *pg_connect(const char *conninfo,
   if (PQresultStatus(res) != PGRES_COMMAND_OK) {
     D_PRINT("[DB] SET search_path failed: %s\n", PQerrorMessage(conn));
     PQclear(res);
-    pg_exit_nicely(conn);
+    PQfinish(conn);
+    return NULL;
   }
 
   /* PQclear PGresult whenever it is no longer needed to avoid memory leaks */
@@ -48,3 +52,337 @@ PGconn *pg_connect(const char *conninfo,
 
   return conn;
 }
+
+static void _stmt_delete(void *data)
+{
+  pgstmt_t *st = (pgstmt_t *)data;
+  xfree(st->sql);
+  xfree(st);
+}
+
+static int _stmt_compare(const void *curr,
+                         const void *stmt)
+{
+  return strcmp(((pgstmt_t *)curr)->sql, ((pgstmt_t *)stmt)->sql);
+}
+
+/* the server drops the statements of a lost or reset connection */
+static void _stmt_clear(pgconn_t *pc)
+{
+  rbtree_delete(pc->stmts);
+  pc->stmts = rbtree_new(_stmt_compare, _stmt_delete, NULL);
+}
+
+static void _disconnect(pgconn_t *pc)
+{
+  PQfinish(pc->conn);
+  pc->conn = NULL;
+  _stmt_clear(pc);
+}
+
+/* the connections are opened on demand, the server starts without
+ * the database */
+pgpool_t *pgpool_new(const char *conninfo,
+                     const char *schema,
+                     const int size)
+{
+  pgpool_t *pool = xmalloc(sizeof(pgpool_t));
+  pool->conninfo = xstrdup(conninfo);
+  pool->schema = xstrdup(schema);
+  pool->size = size;
+  pool->conns = xcalloc(size, sizeof(pgconn_t));
+  pool->idle = xcalloc(size, sizeof(pgconn_t *));
+  int i;
+  for (i = 0; i < size; i++) {
+    pool->conns[i].stmts = rbtree_new(_stmt_compare, _stmt_delete, NULL);
+    pool->idle[i] = &pool->conns[i];
+  }
+  pool->nidle = size;
+  pthread_mutex_init(&pool->mutex, NULL);
+  pthread_cond_init(&pool->cond, NULL);
+  return pool;
+}
+
+/* all the connections are back */
+void pgpool_delete(pgpool_t *pool)
+{
+  int i;
+  for (i = 0; i < pool->size; i++) {
+    if (pool->conns[i].conn) PQfinish(pool->conns[i].conn);
+    rbtree_delete(pool->conns[i].stmts);
+  }
+  pthread_mutex_destroy(&pool->mutex);
+  pthread_cond_destroy(&pool->cond);
+  xfree(pool->idle);
+  xfree(pool->conns);
+  xfree(pool->conninfo);
+  xfree(pool->schema);
+  xfree(pool);
+}
+
+/* an idle connection has nothing to read, unless the server has closed
+ * it (or sent an error) */
+static int _healthy(PGconn *conn)
+{
+  if (PQstatus(conn) != CONNECTION_OK) return 0;
+
+  struct pollfd pfd;
+  pfd.fd = PQsocket(conn);
+  pfd.events = POLLIN;
+  if (poll(&pfd, 1, 0) == 0) return 1;
+  PQconsumeInput(conn);
+  return PQstatus(conn) == CONNECTION_OK;
+}
+
+/* return NULL if no connection is free within PGPOOL_WAIT ms or the
+ * database can't be reached */
+pgconn_t *pgpool_lease(pgpool_t *pool)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  ts.tv_sec += PGPOOL_WAIT / 1000;
+  ts.tv_nsec += (PGPOOL_WAIT % 1000) * 1000000L;
+  if (ts.tv_nsec >= 1000000000L) {
+    ts.tv_sec++;
+    ts.tv_nsec -= 1000000000L;
+  }
+
+  pthread_mutex_lock(&pool->mutex);
+  while (pool->nidle == 0) {
+    if (pthread_cond_timedwait(&pool->cond, &pool->mutex, &ts) == ETIMEDOUT &&
+        pool->nidle == 0) {
+      pthread_mutex_unlock(&pool->mutex);
+      D_PRINT("[DB] no free connection\n");
+      return NULL;
+    }
+  }
+  pgconn_t *pc = pool->idle[--pool->nidle];
+  pthread_mutex_unlock(&pool->mutex);
+
+  /* (re)connect out of the lock */
+  if (pc->conn && !_healthy(pc->conn)) {
+    D_PRINT("[DB] connection lost, reconnecting...\n");
+    PQreset(pc->conn);
+    _stmt_clear(pc);
+    if (PQstatus(pc->conn) != CONNECTION_OK) _disconnect(pc);
+  }
+  if (pc->conn == NULL) {
+    pc->conn = pg_connect(pool->conninfo, pool->schema);
+    /* the slot stays free for the next try */
+    if (pc->conn == NULL) {
+      pgpool_return(pool, pc);
+      return NULL;
+    }
+  }
+  return pc;
+}
+
+/* never blocks, for the network workers;
+ * return NULL if no live connection is idle */
+pgconn_t *pgpool_trylease(pgpool_t *pool)
+{
+  pthread_mutex_lock(&pool->mutex);
+  /* the live connections are on top of the stack */
+  if (pool->nidle == 0 || pool->idle[pool->nidle - 1]->conn == NULL) {
+    pthread_mutex_unlock(&pool->mutex);
+    return NULL;
+  }
+  pgconn_t *pc = pool->idle[--pool->nidle];
+  pthread_mutex_unlock(&pool->mutex);
+
+  /* reconnecting blocks, it is left to pgpool_lease() */
+  if (!_healthy(pc->conn)) {
+    pgpool_return(pool, pc);
+    return NULL;
+  }
+  return pc;
+}
+
+void pgpool_return(pgpool_t *pool,
+                   pgconn_t *pc)
+{
+  PGconn *conn = pc->conn;
+  if (conn) {
+    /* a pipeline broken halfway, its results can't be told apart */
+    if (PQpipelineStatus(conn) != PQ_PIPELINE_OFF)
+      _disconnect(pc);
+    /* a request left its transaction open, or the connection is broken:
+     * reconnected by the next lease, the return never waits for the
+     * server */
+    else if (PQstatus(conn) != CONNECTION_OK ||
+             PQtransactionStatus(conn) != PQTRANS_IDLE)
+      _disconnect(pc);
+  }
+
+  pthread_mutex_lock(&pool->mutex);
+  if (pc->conn)
+    pool->idle[pool->nidle++] = pc;
+  else {
+    /* the live connections are leased first */
+    memmove(pool->idle + 1, pool->idle, pool->nidle * sizeof(pgconn_t *));
+    pool->idle[0] = pc;
+    pool->nidle++;
+  }
+  pthread_cond_signal(&pool->cond);
+  pthread_mutex_unlock(&pool->mutex);
+}
+
+static int _ident(const char c)
+{
+  return isalnum((unsigned char)c) || c == '_' || c == '$';
+}
+
+/* the length of the literal (or quoted identifier) s starts with, 0 if
+ * s doesn't start one; [out, end) - the key so far, an E before a quote
+ * makes a string with backslash escapes */
+static size_t _literal(const char *s,
+                       const char *out,
+                       const char *end)
+{
+  const char *prev = end > out ? end - 1 : NULL;
+  size_t i = 1;
+
+  if (*s == '\'') {
+    int escapes = prev && (*prev == 'E' || *prev == 'e') &&
+                  (prev == out || !_ident(prev[-1]));
+    while (s[i]) {
+      if (escapes && s[i] == '\\' && s[i + 1])
+        i += 2;
+      else if (s[i] == '\'' && s[i + 1] == '\'')
+        i += 2;
+      else if (s[i++] == '\'')
+        return i;
+    }
+    return i;
+  }
+  if (*s == '"') {
+    while (s[i] && s[i] != '"') i++;
+    return s[i] ? i + 1 : i;
+  }
+  /* $tag$ ... $tag$, not a parameter ($1) */
+  if (*s == '$' && !(prev && _ident(*prev)) &&
+      !isdigit((unsigned char)s[1])) {
+    while (s[i] && s[i] != '$' && _ident(s[i])) i++;
+    if (s[i] != '$') return 0;
+    size_t len_tag = i + 1;
+    const char *close = s + len_tag;
+    while ((close = strchr(close, '$'))) {
+      if (strncmp(close, s, len_tag) == 0)
+        return (size_t)(close - s) + len_tag;
+      close++;
+    }
+    return strlen(s);
+  }
+  return 0;
+}
+
+/* the key of a statement, the same query written with other spaces or
+ * comments is the same statement, the literals are kept as they are;
+ * return the key, xfree() it */
+static char *_normalize(const char *sql)
+{
+  char *norm = xmalloc(strlen(sql) + 1);
+  char *dst = norm;
+  int space = 0;
+  int quoted = 0;
+
+  *dst = '\0';
+  while (*sql) {
+    if (sql[0] == '-' && sql[1] == '-') {
+      while (*sql && *sql != '\n') sql++;
+      space = 1;
+      continue;
+    }
+    if (sql[0] == '/' && sql[1] == '*') {
+      /* the block comments nest */
+      int depth = 0;
+      while (*sql) {
+        if (sql[0] == '/' && sql[1] == '*') {
+          depth++;
+          sql += 2;
+        }
+        else if (sql[0] == '*' && sql[1] == '/') {
+          sql += 2;
+          if (--depth == 0) break;
+        }
+        else
+          sql++;
+      }
+      space = 1;
+      continue;
+    }
+    if (*sql == ' ' || *sql == '\t' || *sql == '\r' || *sql == '\n') {
+      space = 1;
+      sql++;
+      continue;
+    }
+
+    if (space && dst > norm) *dst++ = ' ';
+    space = 0;
+
+    size_t len = _literal(sql, norm, dst);
+    quoted = len > 0;
+    if (len == 0) len = 1;
+    memcpy(dst, sql, len);
+    dst += len;
+    sql += len;
+    *dst = '\0';
+  }
+  /* the optional terminator */
+  if (!quoted && dst > norm && *(dst - 1) == ';') {
+    dst--;
+    if (dst > norm && *(dst - 1) == ' ') dst--;
+  }
+  *dst = '\0';
+  return norm;
+}
+
+/* the statement prepared on the connection for sql, a miss adds it
+ * (st->prepared = 0) in place of the least recently used statement,
+ * whose name is left in evicted ("" if none) to be deallocated */
+pgstmt_t *pgconn_stmt(pgconn_t *pc,
+                      const char *sql,
+                      char *evicted)
+{
+  char *norm = _normalize(sql);
+  *evicted = '\0';
+
+  pgstmt_t key;
+  key.sql = norm;
+  pgstmt_t *st = rbtree_search(pc->stmts, &key);
+  if (st) {
+    xfree(norm);
+    st->used = ++pc->clock;
+    return st;
+  }
+
+  if (pc->stmts->size >= PGSTMT_CACHE_SIZE) {
+    rbtrav_t *trav = rbtrav_new();
+    pgstmt_t *lru = rbtrav_first(trav, pc->stmts);
+    pgstmt_t *it;
+    while ((it = rbtrav_next(trav)))
+      if (it->used < lru->used) lru = it;
+    rbtrav_delete(trav);
+
+    strcpy(evicted, lru->name);
+    rbtree_remove(pc->stmts, lru);
+    D_PRINT("[DB] statement %s evicted\n", evicted);
+  }
+
+  st = xmalloc(sizeof(pgstmt_t));
+  st->sql = norm;
+  snprintf(st->name, PGSTMT_NAME, "stmt%u", pc->serial++);
+  st->prepared = 0;
+  st->binary = 0;
+  st->used = ++pc->clock;
+  rbtree_insert(pc->stmts, st);
+  return st;
+}
+
+/* the statement failed to prepare, the server doesn't have it */
+void pgconn_unstmt(pgconn_t *pc,
+                   pgstmt_t *st)
+{
+  D_PRINT("[DB] statement %s not prepared\n", st->name);
+  rbtree_remove(pc->stmts, st);
+}
@@ -5,10 +5,66 @@
 #define _PG_CONN_H_
 
 
-void pg_exit_nicely(PGconn *conn);
+#define PGPOOL_WAIT 5000  /* ms a lease waits for a free connection */
+
+#define PGSTMT_CACHE_SIZE 32  /* statements kept prepared per connection */
+#define PGSTMT_NAME 16
+
+
+/* a statement prepared on a connection, keyed by its normalized text */
+typedef struct {
+  char *sql;
+  char name[PGSTMT_NAME];
+  int prepared;             /* sent to the server */
+  int binary;               /* results in binary, once the text results
+                             * showed every column decodes */
+  unsigned long used;       /* clock of the last use */
+} pgstmt_t;
+
+/* a slot of the pool, conn = NULL: not connected (yet) */
+typedef struct {
+  PGconn *conn;
+  rbtree_t *stmts;          /* pgstmt_t, the least recently used goes */
+  unsigned long clock;      /* bumped by every lookup */
+  unsigned int serial;      /* names the statements */
+} pgconn_t;
+
+/* a connection is leased by one thread at a time, the idle ones are kept
+ * on a stack (the most recently used first) */
+typedef struct {
+  char *conninfo;
+  char *schema;
+  pgconn_t *conns;
+  pgconn_t **idle;
+  int nidle;
+  int size;
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+} pgpool_t;
+
 
 PGconn *pg_connect(const char *conninfo,
                    const char *schema);
 
+pgpool_t *pgpool_new(const char *conninfo,
+                     const char *schema,
+                     const int size);
+
+void pgpool_delete(pgpool_t *pool);
+
+pgconn_t *pgpool_lease(pgpool_t *pool);
+
+pgconn_t *pgpool_trylease(pgpool_t *pool);
+
+void pgpool_return(pgpool_t *pool,
+                   pgconn_t *pc);
+
+pgstmt_t *pgconn_stmt(pgconn_t *pc,
+                      const char *sql,
+                      char *evicted);
+
+void pgconn_unstmt(pgconn_t *pc,
+                   pgstmt_t *st);
+
 
 #endif
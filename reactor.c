@@ -0,0 +1,202 @@
+/* license: MIT license
+ * Copyright (C) 2021  Edward LEI <edward_lei72@hotmail.com> */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/sysinfo.h>
+#include <sys/uio.h>
+#include <libpq-fe.h>
+#include "xmalloc.h"
+#include "util.h"
+#include "rbtree.h"
+#include "twheel.h"
+#include "thpool.h"
+#include "pg_conn.h"
+#include "sllist.h"
+#include "io.h"
+#include "http_header.h"
+#include "http_msg.h"
+#include "http_parser.h"
+#include "http_cache.h"
+#include "http_cfg.h"
+#include "http_method.h"
+#include "http_conn.h"
+#include "epsock.h"
+#include "reactor.h"
+
+#define DEBUG
+#include "debug.h"
+
+
+#define REACTOR_MAXEVENTS 1024
+#define REACTOR_TIMEOUT 500 /* 0.5 second */
+
+
+static void *_reactor_cb(void *arg)
+{
+  reactor_t *r = (reactor_t *)arg;
+  struct epoll_event *events = xcalloc(REACTOR_MAXEVENTS,
+                                       sizeof(struct epoll_event));
+  long loop_time = mstime();
+
+  while (r->state == REACTOR_RUNNING) {
+    int nevents = epoll_wait(r->epfd, events, REACTOR_MAXEVENTS,
+                             REACTOR_TIMEOUT);
+    if (nevents == -1) {
+      if (errno == EINTR) continue;
+      perror("[REACTOR] epoll_wait()");
+      break;
+    }
+
+    /* the connections are handled right here, on the thread (and the core)
+     * which received the event, no task queue in between */
+    int i;
+    for (i = 0; i < nevents; i++) {
+      httpconn_t *conn = (httpconn_t *)events[i].data.ptr;
+      /* own listener; accept the connections into this reactor */
+      if (conn == r->srvconn) {
+        epsock_connect(conn->sockfd, r->epfd, conn->pgpool, conn->cache,
+                       conn->timers, conn->iopool, conn->authdb,
+                       conn->cfg);
+        continue;
+      }
+      /* EPOLLERR and EPOLLHUP also go through the read path,
+       * recv() reports the closed or broken connection */
+      if (events[i].events & (EPOLLIN | EPOLLOUT | EPOLLERR | EPOLLHUP)) {
+        httpconn_hold(conn);
+        httpconn_task(conn);
+      }
+    }
+
+    /* the connections of this reactor time out on its own thread */
+    if ((mstime() - loop_time) >= REACTOR_TIMEOUT) {
+      httpconn_expire(r->timers);
+      loop_time = mstime();
+    }
+  }
+
+  xfree(events);
+  D_PRINT("[REACTOR] reactor %d stopped\n", r->id);
+  return NULL;
+}
+
+reactor_t *reactor_new(const int id)
+{
+  reactor_t *r = xmalloc(sizeof(reactor_t));
+  r->id = id;
+  r->cpu = -1;
+  r->cpu_step = 1;
+  r->srvconn = NULL;
+  r->state = REACTOR_STOPPING;
+  r->epfd = epoll_create1(0);
+  if (r->epfd == -1) {
+    perror("[REACTOR] epoll_create1()");
+    xfree(r);
+    return NULL;
+  }
+  r->timers = twheel_new(REACTOR_TIMEOUT, httpconn_timeout, httpconn_print);
+  return r;
+}
+
+void reactor_delete(reactor_t *r)
+{
+  if (r) {
+    if (r->srvconn) {
+      shutdown(r->srvconn->sockfd, SHUT_RDWR);
+      close(r->srvconn->sockfd);
+      xfree(r->srvconn);
+    }
+    twheel_delete(r->timers);
+    close(r->epfd);
+    xfree(r);
+  }
+}
+
+int reactor_start(reactor_t *r)
+{
+  r->state = REACTOR_RUNNING;
+  if (pthread_create(&r->tid, NULL, _reactor_cb, (void *)r) != 0) {
+    r->state = REACTOR_STOPPING;
+    return -1;
+  }
+  if (r->cpu >= 0) {
+    int ncpus = get_nprocs_conf();
+    int c;
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    for (c = r->cpu; c < ncpus && c < CPU_SETSIZE; c += r->cpu_step)
+      CPU_SET(c, &cpus);
+    if (pthread_setaffinity_np(r->tid, sizeof(cpu_set_t), &cpus) != 0)
+      D_PRINT("[REACTOR] failed to pin reactor %d to cpu %d (+%d)\n", r->id,
+              r->cpu, r->cpu_step);
+  }
+  return 0;
+}
+
+void reactor_stop(reactor_t *r)
+{
+  if (r->state != REACTOR_RUNNING) return;
+  r->state = REACTOR_STOPPING;
+  pthread_join(r->tid, NULL);
+}
+
+/* the reactor accepts on its own listener, the connections it accepts
+ * are registered in its own epoll set */
+int reactor_listen(reactor_t *r,
+                   const int srvfd,
+                   pgpool_t *pgpool,
+                   cache_t *cache,
+                   thpool_t *iopool,
+                   rbtree_t *authdb,
+                   httpcfg_t *cfg)
+{
+  r->srvconn = httpconn_new(srvfd, r->epfd,
+                            pgpool, cache, r->timers, iopool, authdb,
+                            cfg);
+
+  struct epoll_event event;
+  event.data.ptr = (void *)r->srvconn;
+  event.events = EPOLLIN | EPOLLET;
+  if (epoll_ctl(r->epfd, EPOLL_CTL_ADD, srvfd, &event) == -1) {
+    perror("[REACTOR] epoll_ctl()");
+    return -1;
+  }
+  return 0;
+}
+
+/* accepted sockets are spread over the reactors in round-robin,
+ * only the main thread accepts so the cursor needs no lock */
+void reactor_connect(reactor_t **reactors,
+                     const int nreactors,
+                     const int srvfd,
+                     pgpool_t *pgpool,
+                     cache_t *cache,
+                     thpool_t *iopool,
+                     rbtree_t *authdb,
+                     httpcfg_t *cfg)
+{
+  static int next = 0;
+  int clifd;
+
+  while ((clifd = epsock_accept(srvfd)) != -1) {
+    reactor_t *r = reactors[next];
+    next = (next + 1) % nreactors;
+
+    httpconn_t *cliconn = httpconn_new(clifd, r->epfd,
+                                       pgpool, cache, r->timers, iopool,
+                                       authdb, cfg);
+    /* install the new timer, the reactor thread expires the wheel */
+    pthread_mutex_lock(&r->timers->mutex);
+    twheel_add(r->timers, &cliconn->timer, cliconn,
+               mstime() + SOCKET_KEEPALIVE_TIME);
+    pthread_mutex_unlock(&r->timers->mutex);
+
+    if (httpconn_epoll(cliconn, EPOLL_CTL_ADD) == -1) return;
+  }
+}
@@ -0,0 +1,53 @@
+/* license: MIT license
+ * Copyright (C) 2021  Edward LEI <edward_lei72@hotmail.com> */
+
+#ifndef _REACTOR_H_
+#define _REACTOR_H_
+
+
+#define REACTOR_STOPPING 0x1
+#define REACTOR_RUNNING 0x2
+
+
+/* a reactor is a thread owning its own epoll set, the connections
+ * registered in it are read, parsed and answered on that thread only */
+typedef struct {
+  pthread_t tid;
+  int id;
+  int epfd;
+  int cpu;             /* pinned to the cpus c, c % cpu_step == cpu,
+                        * -1 if not pinned */
+  int cpu_step;
+  httpconn_t *srvconn; /* own SO_REUSEPORT listener, NULL if none */
+  twheel_t *timers;    /* keep-alive timeouts of its connections */
+  volatile int state;  /* REACTOR_STOPPING or REACTOR_RUNNING */
+} reactor_t;
+
+
+reactor_t *reactor_new(const int id);
+
+void reactor_delete(reactor_t *r);
+
+int reactor_start(reactor_t *r);
+
+void reactor_stop(reactor_t *r);
+
+int reactor_listen(reactor_t *r,
+                   const int srvfd,
+                   pgpool_t *pgpool,
+                   cache_t *cache,
+                   thpool_t *iopool,
+                   rbtree_t *authdb,
+                   httpcfg_t *cfg);
+
+void reactor_connect(reactor_t **reactors,
+                     const int nreactors,
+                     const int srvfd,
+                     pgpool_t *pgpool,
+                     cache_t *cache,
+                     thpool_t *iopool,
+                     rbtree_t *authdb,
+                     httpcfg_t *cfg);
+
+
+#endif
@@ -55,8 +55,8 @@ void auth_load_users(rbtree_t *authdb,
     /* line[nread-1] is LF, so we set it to '\0' as the string end */
     int len_kv = nread - 1;
     line[len_kv] = '\0';
-    char *id = xmalloc(len_kv);
-    memcpy_fast(id, line, len_kv);
+    char *id = xmalloc(len_kv + 1);
+    memcpy_fast(id, line, len_kv + 1);
     auth_t *user = auth_new();
     user->id = id;
     user->pass = split_kv(id, '=');
@@ -28,6 +28,7 @@ void sqlobj_destroy(sqlobj_t *sqlo)
     if (sqlo->values[i]) xfree(sqlo->values[i]);
     i++;
   } while (i < sqlo->nkeys);
+  if (sqlo->statement) xfree(sqlo->statement);
   xfree(sqlo);
 }
 
@@ -38,7 +39,10 @@ sqlobj_t *sql_parse_json(void *data)
   struct json_object_element_s *e0 = (struct json_object_element_s *)data;
   struct json_string_s *e0_vs = json_value_as_string(e0->value);
   D_PRINT("value = %s\n", e0_vs->string);
+  /* no limit on the length of the query */
+  sqlo->statement = xmalloc(e0_vs->string_size + 1);
   memcpy_fast(sqlo->statement, e0_vs->string, e0_vs->string_size);
+  sqlo->statement[e0_vs->string_size] = '\0';
 
   /* ex. "viscols":1 */
   struct json_object_element_s *e1 = e0->next;
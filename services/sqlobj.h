@@ -9,7 +9,7 @@
 
 
 typedef struct {
-  char statement[256];
+  char *statement;
   char *keys[MAX_SQL_KEYS];
   char *values[MAX_SQL_KEYS];
   int nkeys;
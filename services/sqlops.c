@@ -2,10 +2,18 @@
  * Copyright (C) 2021  Edward LEI <edward_lei72@hotmail.com> */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
+#include <limits.h>
+#include <float.h>
+#include <math.h>
+#include <sys/uio.h>
 #include <libpq-fe.h>
+#include "xmalloc.h"
 #include "io.h"
 #include "util.h"
+#include "rbtree.h"
 #include "pg_conn.h"
 #include "sqlobj.h"
 #include "sqlops.h"
@@ -14,181 +22,617 @@
 #include "debug.h"
 
 
-void _parse_result(char *res,
-                   PGresult *pgres,
-                   const int viscols)
+/* the types decoded here, as in catalog/pg_type.h of the server */
+#define BOOLOID 16
+#define NAMEOID 19
+#define INT8OID 20
+#define INT2OID 21
+#define INT4OID 23
+#define TEXTOID 25
+#define OIDOID 26
+#define JSONOID 114
+#define UNKNOWNOID 705
+#define FLOAT4OID 700
+#define FLOAT8OID 701
+#define BPCHAROID 1042
+#define VARCHAROID 1043
+#define DATEOID 1082
+#define TIMESTAMPOID 1114
+#define NUMERICOID 1700
+#define JSONBOID 3802
+
+#define NUMERIC_NEG 0x4000
+#define NUMERIC_NAN 0xC000
+#define NUMERIC_PINF 0xD000
+#define NUMERIC_NINF 0xF000
+
+#define PG_EPOCH_JDATE 2451545  /* 2000-01-01 */
+#define USECS_PER_DAY 86400000000L
+
+
+/* room for len more bytes at the end of the buffer */
+static char *_reserve(sqlfetch_t *f,
+                      const size_t len)
 {
-  int i, j;
+  if (f->len + len > f->size) {
+    /* a single row may be larger than a chunk */
+    f->size = f->len + len > f->size * 2 ? f->len + len : f->size * 2;
+    f->buf = xrealloc(f->buf, f->size);
+  }
+  return f->buf + f->len;
+}
 
-  int nFields = PQnfields(pgres);
-  char *ret = strbld(res, "{");
-  /* show attribute names? */
-  if (viscols) {
-    ret = strbld(ret, "\"h\":{\"hd\":[");
-    for (i = 0; i < nFields; i++) {
-      ret = strbld(ret, "\"");
-      ret = strbld(ret, PQfname(pgres, i));
-      if (i != nFields - 1)
-        ret = strbld(ret, "\",");
-      else
-        ret = strbld(ret, "\"]},");
+static void _append(sqlfetch_t *f,
+                    const char *s,
+                    const size_t len)
+{
+  memcpy(_reserve(f, len), s, len);
+  f->len += len;
+}
+
+static void _appends(sqlfetch_t *f,
+                     const char *s)
+{
+  _append(f, s, strlen(s));
+}
+
+/* a JSON string, the quotes, the backslashes and the control characters
+ * are escaped, the runs between them are copied as they are */
+static void _append_str(sqlfetch_t *f,
+                        const char *s,
+                        const size_t len)
+{
+  size_t i;
+  size_t run = 0;
+  char esc[8];
+
+  _append(f, "\"", 1);
+  for (i = 0; i < len; i++) {
+    unsigned char c = s[i];
+    if (c >= 0x20 && c != '"' && c != '\\') continue;
+
+    _append(f, s + run, i - run);
+    run = i + 1;
+    switch (c) {
+      case '"': _append(f, "\\\"", 2); break;
+      case '\\': _append(f, "\\\\", 2); break;
+      case '\n': _append(f, "\\n", 2); break;
+      case '\r': _append(f, "\\r", 2); break;
+      case '\t': _append(f, "\\t", 2); break;
+      case '\b': _append(f, "\\b", 2); break;
+      case '\f': _append(f, "\\f", 2); break;
+      default: _append(f, esc, sprintf(esc, "\\u%04x", c));
     }
   }
+  _append(f, s + run, len - run);
+  _append(f, "\"", 1);
+}
 
-  /* next, show the row values */
-  int nRows = PQntuples(pgres);
-  for (i = 0; i < nRows; i++) {
-    if (i == 0)
-      ret = strbld(ret, "\"d\":{\"r");
-    else
-      ret = strbld(ret, "\"r");
-
-    char tmp[64];
-    sprintf(tmp, "%03d", i);
-    ret = strbld(ret, tmp);
-    ret = strbld(ret, "\":[");
-
-    for (j = 0; j < nFields; j++) {
-      *ret++ = '"';
-      ret = strbld(ret, PQgetvalue(pgres, i, j));
-      if (j != nFields - 1)
-        ret = strbld(ret, "\",");
+static void _append_long(sqlfetch_t *f,
+                         const long n)
+{
+  /* ltos() terminates the digits */
+  f->len += ltos(_reserve(f, 24), n);
+}
+
+/* the shortest form which reads back the same value */
+static void _append_float(sqlfetch_t *f,
+                          const double d,
+                          const int single)
+{
+  char tmp[32];
+  int len;
+  int prec = single ? FLT_DIG : DBL_DIG;
+  int max = single ? FLT_DECIMAL_DIG : DBL_DECIMAL_DIG;
+
+  if (isnan(d)) {
+    _appends(f, "\"NaN\"");
+    return;
+  }
+  if (isinf(d)) {
+    _appends(f, d > 0 ? "\"Infinity\"" : "\"-Infinity\"");
+    return;
+  }
+
+  for (;; prec++) {
+    len = sprintf(tmp, "%.*g", prec, d);
+    if (prec == max) break;
+    if (single ? (float)strtod(tmp, NULL) == (float)d :
+                 strtod(tmp, NULL) == d) break;
+  }
+  _append(f, tmp, len);
+}
+
+/* a big-endian integer of the binary format */
+static unsigned long _be(const char *v,
+                         const int len)
+{
+  const unsigned char *p = (const unsigned char *)v;
+  unsigned long u = 0;
+  int i;
+
+  for (i = 0; i < len; i++) u = u << 8 | p[i];
+  return u;
+}
+
+/* numeric_out() of the server, the digits are in base 10000 */
+static void _append_numeric(sqlfetch_t *f,
+                            const char *v,
+                            const int len)
+{
+  int ndigits = (short)_be(v, 2);
+  int weight = (short)_be(v + 2, 2);
+  int sign = _be(v + 4, 2);
+  int dscale = (short)_be(v + 6, 2);
+  const char *digits = v + 8;
+  int d, i, dig;
+
+  if (sign == NUMERIC_NAN || len < 8 + ndigits * 2) {
+    _appends(f, "\"NaN\"");
+    return;
+  }
+  if (sign == NUMERIC_PINF || sign == NUMERIC_NINF) {
+    _appends(f, sign == NUMERIC_PINF ? "\"Infinity\"" : "\"-Infinity\"");
+    return;
+  }
+
+  /* the sign, the integral digits, the point, the scale and the last
+   * group of 4 digits which may run over the scale */
+  size_t max = (weight > 0 ? weight + 1 : 1) * 4 + dscale + 24;
+  char *cp = _reserve(f, max);
+  char *start = cp;
+
+  if (sign == NUMERIC_NEG) *cp++ = '-';
+  if (weight < 0) {
+    d = weight + 1;
+    *cp++ = '0';
+  }
+  else {
+    for (d = 0; d <= weight; d++) {
+      dig = d < ndigits ? (short)_be(digits + d * 2, 2) : 0;
+      /* no leading zeros in the first group */
+      if (d == 0) {
+        cp += ltos(cp, dig);
+        continue;
+      }
+      cp[0] = '0' + dig / 1000;
+      cp[1] = '0' + dig / 100 % 10;
+      cp[2] = '0' + dig / 10 % 10;
+      cp[3] = '0' + dig % 10;
+      cp += 4;
+    }
+  }
+
+  if (dscale > 0) {
+    *cp++ = '.';
+    char *end = cp + dscale;
+    for (i = 0; i < dscale; d++, i += 4) {
+      dig = d >= 0 && d < ndigits ? (short)_be(digits + d * 2, 2) : 0;
+      cp[0] = '0' + dig / 1000;
+      cp[1] = '0' + dig / 100 % 10;
+      cp[2] = '0' + dig / 10 % 10;
+      cp[3] = '0' + dig % 10;
+      cp += 4;
+    }
+    cp = end;
+  }
+  f->len += cp - start;
+}
+
+/* j2date() of the server, the calendar date of a julian day */
+static void _j2date(const int jd,
+                    int *year,
+                    int *month,
+                    int *day)
+{
+  unsigned int julian = jd + 32044;
+  unsigned int quad = julian / 146097;
+  unsigned int extra = (julian - quad * 146097) * 4 + 3;
+  int y;
+
+  julian += 60 + quad * 3 + extra / 146097;
+  quad = julian / 1461;
+  julian -= quad * 1461;
+  y = julian * 4 / 1461;
+  julian = ((y != 0) ? ((julian + 305) % 365) : ((julian + 306) % 366)) + 123;
+  y += quad * 4;
+  *year = y - 4800;
+  quad = julian * 2141 / 65536;
+  *day = julian - 7834 * quad / 256;
+  *month = (quad + 10) % 12 + 1;
+}
+
+/* "2021-06-01 12:30:05.25" as the server prints it (DateStyle ISO),
+ * days since 2000-01-01 and usecs of the day, usecs < 0: a date */
+static void _append_datetime(sqlfetch_t *f,
+                             const long days,
+                             const long usecs)
+{
+  char tmp[64];
+  int y, m, d;
+  int len;
+
+  _j2date(days + PG_EPOCH_JDATE, &y, &m, &d);
+  len = sprintf(tmp, "\"%04d-%02d-%02d", y > 0 ? y : 1 - y, m, d);
+  if (usecs >= 0) {
+    long secs = usecs / 1000000;
+    len += sprintf(tmp + len, " %02ld:%02ld:%02ld",
+                   secs / 3600, secs / 60 % 60, secs % 60);
+    if (usecs % 1000000) {
+      len += sprintf(tmp + len, ".%06ld", usecs % 1000000);
+      while (tmp[len - 1] == '0') len--;
+    }
+  }
+  if (y <= 0) len += sprintf(tmp + len, " BC");
+  tmp[len++] = '"';
+  _append(f, tmp, len);
+}
+
+/* the types decoded from their binary format, the others are only
+ * taken as text */
+static int _binary_type(const Oid type)
+{
+  switch (type) {
+    case BOOLOID: case INT2OID: case INT4OID: case INT8OID: case OIDOID:
+    case FLOAT4OID: case FLOAT8OID: case NUMERICOID:
+    case DATEOID: case TIMESTAMPOID:
+    case JSONOID: case JSONBOID:
+    case TEXTOID: case VARCHAROID: case BPCHAROID: case NAMEOID:
+    case UNKNOWNOID:
+      return 1;
+    default:
+      return 0;
+  }
+}
+
+static void _encode_binary(sqlfetch_t *f,
+                           const Oid type,
+                           const char *v,
+                           const int len)
+{
+  union { unsigned int u; float f; } f4;
+  union { unsigned long u; double f; } f8;
+  long t;
+
+  switch (type) {
+    case BOOLOID:
+      _appends(f, *v ? "true" : "false");
+      break;
+    case INT2OID:
+      _append_long(f, (short)_be(v, 2));
+      break;
+    case INT4OID:
+      _append_long(f, (int)_be(v, 4));
+      break;
+    case INT8OID:
+      _append_long(f, (long)_be(v, 8));
+      break;
+    case OIDOID:
+      _append_long(f, (unsigned int)_be(v, 4));
+      break;
+    case FLOAT4OID:
+      f4.u = _be(v, 4);
+      _append_float(f, f4.f, 1);
+      break;
+    case FLOAT8OID:
+      f8.u = _be(v, 8);
+      _append_float(f, f8.f, 0);
+      break;
+    case NUMERICOID:
+      _append_numeric(f, v, len);
+      break;
+    case DATEOID:
+      t = (int)_be(v, 4);
+      if (t == INT_MAX || t == INT_MIN)
+        _appends(f, t > 0 ? "\"infinity\"" : "\"-infinity\"");
+      else
+        _append_datetime(f, t, -1);
+      break;
+    case TIMESTAMPOID:
+      t = (long)_be(v, 8);
+      if (t == LONG_MAX || t == LONG_MIN)
+        _appends(f, t > 0 ? "\"infinity\"" : "\"-infinity\"");
       else {
-        if (i != nRows - 1)
-          ret = strbld(ret, "\"],");
-        else
-          ret = strbld(ret, "\"]}");
+        long days = t / USECS_PER_DAY;
+        long usecs = t % USECS_PER_DAY;
+        if (usecs < 0) {
+          usecs += USECS_PER_DAY;
+          days--;
+        }
+        _append_datetime(f, days, usecs);
       }
+      break;
+    case JSONOID:
+      _append(f, v, len);
+      break;
+    case JSONBOID:
+      /* after the version byte */
+      _append(f, v + 1, len - 1);
+      break;
+    default:
+      _append_str(f, v, len);
+  }
+}
+
+static void _encode_text(sqlfetch_t *f,
+                         const Oid type,
+                         const char *v,
+                         const int len)
+{
+  switch (type) {
+    case BOOLOID:
+      _appends(f, *v == 't' ? "true" : "false");
+      break;
+    case INT2OID: case INT4OID: case INT8OID: case OIDOID:
+    case JSONOID: case JSONBOID:
+      _append(f, v, len);
+      break;
+    case FLOAT4OID: case FLOAT8OID: case NUMERICOID:
+      /* NaN and (-)Infinity are no JSON numbers */
+      if (len && isdigit((unsigned char)v[len - 1]))
+        _append(f, v, len);
+      else
+        _append_str(f, v, len);
+      break;
+    default:
+      _append_str(f, v, len);
+  }
+}
+
+/* {"h":{"hd":["id","name"]}, the statement's results are taken in binary
+ * from its next execution on if every field decodes */
+static void _encode_head(sqlfetch_t *f,
+                         const PGresult *pgres)
+{
+  int i;
+  int nfields = PQnfields(pgres);
+  int binary = 1;
+
+  f->head = 1;
+  f->nfields = nfields;
+  f->types = xmalloc(nfields * sizeof(Oid));
+  for (i = 0; i < nfields; i++) {
+    f->types[i] = PQftype(pgres, i);
+    binary &= _binary_type(f->types[i]);
+  }
+  if (!f->binary && binary && f->st) f->st->binary = 1;
+
+  _appends(f, "{");
+  /* show attribute names? */
+  if (f->viscols) {
+    _appends(f, "\"h\":{\"hd\":[");
+    for (i = 0; i < nfields; i++) {
+      if (i) _appends(f, ",");
+      _append_str(f, PQfname(pgres, i), strlen(PQfname(pgres, i)));
     }
+    _appends(f, "]}");
   }
-  *ret++ = '}';
-  *ret++ = '\0';
-  PQclear(pgres);
 }
 
-void sql_select(char *res,
-                PGconn *pgconn,
-                const sqlobj_t *sqlo)
+/* ,"d":{"r000":[1,"edward"],"r001":[...] */
+static void _encode_rows(sqlfetch_t *f,
+                         const PGresult *pgres)
 {
-  const char *sql = sqlo->statement;
+  int i, j;
+  int nrows = PQntuples(pgres);
 
-  /* Start a transaction block */
-  PGresult *pgres = PQexec(pgconn, "BEGIN");
-  if (PQresultStatus(pgres) != PGRES_COMMAND_OK) {
-    D_PRINT("BEGIN command failed: %s\n", PQerrorMessage(pgconn));
-    PQclear(pgres);
-    pg_exit_nicely(pgconn);
-  }
-  PQclear(pgres);
-
-  /* prepare statement name */
-  const char *stmt = "prep_select";
-  pgres = PQprepare(pgconn,
-                    stmt,
-                    sql,
-                    0,
-                    NULL);
-  if (PQresultStatus(pgres) != PGRES_COMMAND_OK) {
-    D_PRINT("PREPARE failed: %s\n", PQerrorMessage(pgconn));
-    PQclear(pgres);
-    pg_exit_nicely(pgconn);
-  }
-  PQclear(pgres);
-
-  /* execute the prepared statement */
-  pgres = PQexecPrepared(pgconn,
-                         stmt,
-                         0,
-                         NULL,
-                         NULL,
-                         NULL,
-                         0);  /* text result */
-  if (PQresultStatus(pgres) != PGRES_TUPLES_OK) {
-    D_PRINT("SELECT failed: %s\n", PQerrorMessage(pgconn));
-    PQclear(pgres);
-    pg_exit_nicely(pgconn);
+  for (i = 0; i < nrows; i++) {
+    if (f->nrows == 0)
+      _appends(f, f->viscols ? ",\"d\":{" : "\"d\":{");
+    else
+      _appends(f, ",");
+
+    char tmp[32];
+    int len = sprintf(tmp, "\"r%03ld\":[", f->nrows++);
+    _append(f, tmp, len);
+
+    for (j = 0; j < f->nfields; j++) {
+      if (j) _appends(f, ",");
+      if (PQgetisnull(pgres, i, j))
+        _appends(f, "null");
+      else if (f->binary)
+        _encode_binary(f, f->types[j], PQgetvalue(pgres, i, j),
+                       PQgetlength(pgres, i, j));
+      else
+        _encode_text(f, f->types[j], PQgetvalue(pgres, i, j),
+                     PQgetlength(pgres, i, j));
+    }
+    _appends(f, "]");
   }
+}
+
+static void _encode_end(sqlfetch_t *f)
+{
+  if (!f->head) _appends(f, "{");
+  if (f->nrows) _appends(f, "}");
+  _appends(f, "}");
+}
+
+static int _fetch_end(sqlfetch_t *f)
+{
+  PQsetnonblocking(f->pc->conn, 0);
+  if (f->failed) return -1;
+  _encode_end(f);
+  return 0;
+}
 
-  /* parse the result set */
-  _parse_result(res, pgres, sqlo->viscols);
-  D_PRINT("[SQL] pg result: %s\n", res);
+/* the connection leaves the pipeline mode before it goes back to the pool,
+ * a transaction the statement left open is rolled back first, without
+ * waiting for the server */
+static int _pipeline_end(sqlfetch_t *f)
+{
+  PGconn *pgconn = f->pc->conn;
+  PQexitPipelineMode(pgconn);
 
-  /* Deallocate all prepared statements */
-  pgres = PQexec(pgconn, "DEALLOCATE ALL");
-  PQclear(pgres);
+  PGTransactionStatusType tx = PQtransactionStatus(pgconn);
+  if (tx != PQTRANS_INTRANS && tx != PQTRANS_INERROR) return _fetch_end(f);
 
-  /* end the transaction */
-  pgres = PQexec(pgconn, "END");
-  PQclear(pgres);
+  D_PRINT("[SQL] transaction left open, rolled back\n");
+  if (!PQsendQuery(pgconn, "ROLLBACK")) return -1;
+  f->rollback = 1;
+  int rc = PQflush(pgconn);
+  if (rc == -1) return -1;
+  return rc == 1 ? SQL_WRITE : SQL_READ;
 }
 
-void sql_fetch(char *res,
-               PGconn *pgconn,
-               const sqlobj_t *sqlo)
+static int _send(PGconn *pgconn,
+                 const char *sql)
 {
-  char sql[256];
-  char *ret = strbld(sql, "DECLARE portal CURSOR FOR ");
-  ret = strbld(ret, sqlo->statement);
-  *ret++ = '\0';
+  /* the simple query protocol is not allowed in a pipeline */
+  return PQsendQueryParams(pgconn, sql, 0, NULL, NULL, NULL, NULL, 0);
+}
 
-  /* Start a transaction block */
-  PGresult *pgres = PQexec(pgconn, "BEGIN");
-  if (PQresultStatus(pgres) != PGRES_COMMAND_OK) {
-    D_PRINT("BEGIN command failed: %s\n", PQerrorMessage(pgconn));
-    PQclear(pgres);
-    pg_exit_nicely(pgconn);
-  }
-  PQclear(pgres);
-
-  /* prepare statement name */
-  const char *stmt = "prep_cursor";
-  pgres = PQprepare(pgconn,
-                    stmt,
-                    sql,
-                    0,
-                    NULL);
-  if (PQresultStatus(pgres) != PGRES_COMMAND_OK) {
-    D_PRINT("PREPARE failed: %s\n", PQerrorMessage(pgconn));
-    PQclear(pgres);
-    pg_exit_nicely(pgconn);
-  }
-  PQclear(pgres);
-
-  /* execute the prepared statement */
-  pgres = PQexecPrepared(pgconn,
-                         stmt,
-                         0,
-                         NULL,
-                         NULL,
-                         NULL,
-                         0);  /* text result */
-  if (PQresultStatus(pgres) != PGRES_COMMAND_OK) {
-    D_PRINT("OPEN CURSOR failed: %s\n", PQerrorMessage(pgconn));
-    PQclear(pgres);
-    pg_exit_nicely(pgconn);
+/* the statement of the query is prepared once per connection (the server
+ * keeps its plan), it is queued behind the evicted statement's
+ * deallocation, synced apart so that a failed query doesn't abort it;
+ * the server gets them in one round trip;
+ * return - 0: sent (or being sent), poll for the results, -1: failed */
+int sql_fetch_send(sqlfetch_t *f,
+                   pgconn_t *pc,
+                   const sqlobj_t *sqlo)
+{
+  PGconn *pgconn = pc->conn;
+  f->pc = pc;
+  f->viscols = sqlo->viscols;
+  f->types = NULL;
+  f->failed = 0;
+  f->dealloc = 0;
+  f->rollback = 0;
+  f->head = 0;
+  f->nrows = 0;
+  f->buf = NULL;
+  f->len = 0;
+  f->size = 0;
+
+  if (PQsetnonblocking(pgconn, 1) == -1) return -1;
+  if (!PQenterPipelineMode(pgconn)) {
+    PQsetnonblocking(pgconn, 0);
+    return -1;
   }
-  PQclear(pgres);
 
-  pgres = PQexec(pgconn, "FETCH ALL in portal");
-  if (PQresultStatus(pgres) != PGRES_TUPLES_OK) {
-    D_PRINT("FETCH ALL failed: %s\n", PQerrorMessage(pgconn));
-    PQclear(pgres);
-    pg_exit_nicely(pgconn);
+  char deallocate[32];
+  char *evicted = strbld(deallocate, "DEALLOCATE ");
+  pgstmt_t *st = pgconn_stmt(pc, sqlo->statement, evicted);
+  f->st = st;
+  f->binary = st->binary;
+  /* a statement whose PREPARE fails is dropped by sql_fetch_poll(), a
+   * pipeline broken halfway drops the connection */
+  f->prepare = !st->prepared;
+  st->prepared = 1;
+
+  if (*evicted) {
+    if (!_send(pgconn, deallocate) || !PQpipelineSync(pgconn)) {
+      D_PRINT("[SQL] pipeline failed: %s\n", PQerrorMessage(pgconn));
+      return -1;
+    }
+    f->dealloc = 1;
   }
+  /* the client's text, the key only tells the statements apart */
+  if ((f->prepare &&
+       !PQsendPrepare(pgconn, st->name, sqlo->statement, 0, NULL)) ||
+      !PQsendQueryPrepared(pgconn, st->name, 0, NULL, NULL, NULL,
+                           st->binary) ||
+      !PQpipelineSync(pgconn)) {
+    D_PRINT("[SQL] pipeline failed: %s\n", PQerrorMessage(pgconn));
+    return -1;
+  }
+  /* only taken if the statement is the first query of the pipeline,
+   * sql_fetch_poll() asks again when its turn comes */
+  PQsetSingleRowMode(pgconn);
+  return 0;
+}
 
-  /* parse the result set */
-  _parse_result(res, pgres, sqlo->viscols);
-  D_PRINT("[SQL] pg result: %s\n", res);
+/* never blocks, called when the socket of the connection is ready, the
+ * rows come one at a time (single row mode), what the server sends
+ * while a chunk waits for the client stays in the socket;
+ * return - SQL_READ / SQL_WRITE: wait for the socket,
+ *          SQL_CHUNK: f->buf holds a chunk, send it and empty it,
+ *          0: f->buf holds the rest of the result set, -1: failed */
+int sql_fetch_poll(sqlfetch_t *f)
+{
+  PGconn *pgconn = f->pc->conn;
 
-  /* Deallocate all prepared statements */
-  pgres = PQexec(pgconn, "DEALLOCATE ALL");
-  PQclear(pgres);
+  /* the rest of the pipeline the socket didn't take */
+  int rc = PQflush(pgconn);
+  if (rc == -1) return -1;
+  if (rc == 1) return SQL_WRITE;
 
-  /* close the portal ... we don't bother to check for errors ... */
-  pgres = PQexec(pgconn, "CLOSE portal");
-  PQclear(pgres);
+  if (!PQconsumeInput(pgconn)) {
+    D_PRINT("[SQL] pipeline broken: %s\n", PQerrorMessage(pgconn));
+    return -1;
+  }
 
-  /* end the transaction */
-  pgres = PQexec(pgconn, "END");
-  PQclear(pgres);
+  while (!PQisBusy(pgconn)) {
+    PGresult *pgres = PQgetResult(pgconn);
+    if (pgres == NULL) {
+      /* the rollback is done, out of the pipeline */
+      if (f->rollback) return _fetch_end(f);
+      /* the end of the results of one query, the next may be the
+       * statement */
+      PQsetSingleRowMode(pgconn);
+      continue;
+    }
+
+    /* the deallocation goes first, its failure is not the query's */
+    if (f->dealloc) {
+      if (PQresultStatus(pgres) == PGRES_PIPELINE_SYNC) f->dealloc = 0;
+      else if (PQresultStatus(pgres) != PGRES_COMMAND_OK)
+        D_PRINT("[SQL] deallocation failed: %s\n",
+                PQresultErrorMessage(pgres));
+      PQclear(pgres);
+      continue;
+    }
+    /* the server has the statement once its PREPARE succeeded, a runtime
+     * error of the query leaves it prepared */
+    if (f->prepare) {
+      f->prepare = 0;
+      if (PQresultStatus(pgres) != PGRES_COMMAND_OK) {
+        pgconn_unstmt(f->pc, f->st);
+        f->st = NULL;
+      }
+    }
+
+    switch (PQresultStatus(pgres)) {
+      case PGRES_PIPELINE_SYNC:
+        PQclear(pgres);
+        return _pipeline_end(f);
+
+      case PGRES_SINGLE_TUPLE:
+      case PGRES_TUPLES_OK:
+        /* the statement, the only query which returns rows, the last
+         * result of the single row mode has none */
+        if (!f->head) _encode_head(f, pgres);
+        _encode_rows(f, pgres);
+        PQclear(pgres);
+        if (f->len >= SQL_CHUNK_SIZE) return SQL_CHUNK;
+        continue;
+
+      case PGRES_COMMAND_OK:
+        break;
+
+      default:
+        /* the connection doesn't go back to the pool in a transaction */
+        if (f->rollback) {
+          D_PRINT("[SQL] rollback failed: %s\n", PQresultErrorMessage(pgres));
+          break;
+        }
+        /* the first error, the rest are PGRES_PIPELINE_ABORTED */
+        if (!f->failed)
+          D_PRINT("[SQL] pipeline query failed: %s\n",
+                  PQresultErrorMessage(pgres));
+        f->failed = 1;
+    }
+    PQclear(pgres);
+  }
+  return SQL_READ;
+}
+
+void sql_fetch_clear(sqlfetch_t *f)
+{
+  if (f->buf) xfree(f->buf);
+  if (f->types) xfree(f->types);
+  f->buf = NULL;
+  f->types = NULL;
+  f->len = 0;
+  f->size = 0;
 }
@@ -5,13 +5,41 @@
 #define _SQLOPS_
 
 
-void sql_select(char *res,
-                PGconn *pgconn,
-                const sqlobj_t *sqlo);
+#define SQL_CHUNK_SIZE 16384  /* JSON encoded before it is sent */
 
-void sql_fetch(char *res,
-               PGconn *pgconn,
-               const sqlobj_t *sqlo);
+/* sql_fetch_poll() */
+#define SQL_READ 1   /* wait for the socket */
+#define SQL_WRITE 2
+#define SQL_CHUNK 3  /* a chunk is ready */
+
+/* a query sent as one pipeline, its rows are encoded as they come,
+ * a chunk at a time */
+typedef struct {
+  pgconn_t *pc;
+  pgstmt_t *st;
+  int viscols;
+  int binary;               /* the results come in binary */
+  int nfields;
+  Oid *types;               /* of the fields, the values are typed by */
+  int failed;               /* a query of the pipeline failed */
+  int dealloc;              /* the evicted statement's results come first */
+  int prepare;              /* the PREPARE's result comes next */
+  int rollback;             /* the statement left its transaction open */
+  int head;                 /* the field names are encoded */
+  long nrows;               /* rows encoded */
+  char *buf;                /* encoded, not sent yet */
+  size_t len;
+  size_t size;
+} sqlfetch_t;
+
+
+int sql_fetch_send(sqlfetch_t *f,
+                   pgconn_t *pc,
+                   const sqlobj_t *sqlo);
+
+int sql_fetch_poll(sqlfetch_t *f);
+
+void sql_fetch_clear(sqlfetch_t *f);
 
 
 #endif
@@ -3,10 +3,13 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <assert.h>
 #include <errno.h>
 #include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
 #include "xmalloc.h"
 #include "memcpy_sse2.h"
 #include "util.h"
@@ -17,84 +20,244 @@
 
 
 #define CHUNK_SIZE 2048
-#define BUF_MAX_SIZE 8192
 
 
-unsigned char *io_socket_read(const int sockfd,
-                              int *rc)
+/* buf    - receive buffer, grown as needed, the bytes are appended
+ * size   - capacity of the buffer
+ * len    - bytes in the buffer
+ * want   - the buffer is grown to hold at least want bytes
+ *
+ * return - 1: connection alive, 0: closed by the client, -1: error */
+int io_socket_read(const int sockfd,
+                   unsigned char **buf,
+                   size_t *size,
+                   size_t *len,
+                   const size_t want)
 {
-  int n;
-  unsigned char buf[CHUNK_SIZE];
-  unsigned char workbuf[BUF_MAX_SIZE];
-  unsigned char *last;
-  int last_sz;
-
-  unsigned char *bytes = NULL;
-
-  workbuf[0] = '\0';
-  last = workbuf;
-  last_sz = 0;
+  size_t need = *len + CHUNK_SIZE / 4;
+  if (need < want) need = want;
+  if (*size < need) {
+    size_t newsize = *size ? *size : CHUNK_SIZE;
+    while (newsize < need) newsize <<= 1;
+    *buf = xrealloc(*buf, newsize);
+    *size = newsize;
+  }
 
-  /* use loop to read as much as possible in a task */
+  /* use loop to read as much as the buffer holds in a task */
   for (;;) {
-    n = recv(sockfd, buf, CHUNK_SIZE, 0);
+    size_t room = *size - *len;
+    if (room == 0) return 1;
+
+    ssize_t n = recv(sockfd, *buf + *len, room, 0);
     /* the client close the socket: EOF reached */
-    if (n == 0) {
-      *rc = 0;
-      return NULL;
-    }
+    if (n == 0) return 0;
 
     if (n == -1) {
+      if (errno == EINTR) continue;
       /* normally errno = EAGAIN, this is expected behaviour */
-      *rc = 1;
-      return NULL;
+      if (errno == EAGAIN || errno == EWOULDBLOCK) return 1;
+      return -1;
     }
 
-    memcpy_fast(last, buf, n);
-    last += n;
-    last_sz += n;
-
-    if (n < CHUNK_SIZE) {
-      *last = '\0';
-      last_sz++;
-      bytes = xmalloc(last_sz);
-      memcpy_fast(bytes, workbuf, last_sz);
-      *rc = 1;
-      return bytes;
+    *len += n;
+    /* short read, the socket is drained */
+    if (n < room) return 1;
+  }
+}
+
+/*---------------------------- write queue -----------------------------------*/
+void ioqueue_init(ioqueue_t *q,
+                  const int sockfd)
+{
+  q->sockfd = sockfd;
+  q->head = NULL;
+  q->tail = NULL;
+  q->len = 0;
+}
+
+static void _ioq_append(ioqueue_t *q,
+                        ionode_t *n)
+{
+  n->next = NULL;
+  if (q->tail) q->tail->next = n;
+  else q->head = n;
+  q->tail = n;
+  q->len += n->len;
+}
+
+static void _ioq_pop(ioqueue_t *q)
+{
+  ionode_t *n = q->head;
+  q->head = n->next;
+  if (q->head == NULL) q->tail = NULL;
+  if (n->fd != -1) close(n->fd);
+  if (n->data) xfree(n->data);
+  xfree(n);
+}
+
+void ioqueue_clear(ioqueue_t *q)
+{
+  while (q->head) _ioq_pop(q);
+  q->len = 0;
+}
+
+/* send as much as the socket takes, the iovecs are advanced past it
+ *
+ * return - 0: all sent or the socket is full, -1: error */
+static int _sendmsg(const int sockfd,
+                    struct iovec **iov,
+                    int *iovcnt,
+                    const int flags)
+{
+  struct msghdr mh = {0};
+  ssize_t n;
+
+  while (*iovcnt > 0) {
+    mh.msg_iov = *iov;
+    mh.msg_iovlen = *iovcnt;
+    n = sendmsg(sockfd, &mh, flags | MSG_NOSIGNAL);
+    if (n == -1) {
+      if (errno == EINTR) continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+      return -1;
     }
 
-    nsleep(10);
+    /* skip what has been sent */
+    while (*iovcnt > 0 && (size_t)n >= (*iov)->iov_len) {
+      n -= (*iov)->iov_len;
+      (*iov)++;
+      (*iovcnt)--;
+    }
+    if (*iovcnt > 0) {
+      (*iov)->iov_base = (char *)(*iov)->iov_base + n;
+      (*iov)->iov_len -= n;
+    }
   }
+  return 0;
 }
 
-void io_socket_write(const int sockfd,
-                     const unsigned char *bytes,
-                     const size_t len)
+/* the bytes are sent right away if nothing is waiting in the queue,
+ * what the socket doesn't take is copied into the queue
+ *
+ * flags  - MSG_MORE if more data follows right after
+ * return - 0: sent or queued, -1: error */
+int ioqueue_writev(ioqueue_t *q,
+                   struct iovec *iov,
+                   int iovcnt,
+                   const int flags)
 {
-  int n;
-  const unsigned char *last;
-  size_t done_sz;
-  size_t left_sz;
+  /* keep the order, nothing jumps the queue */
+  if (q->head == NULL && _sendmsg(q->sockfd, &iov, &iovcnt, flags) == -1)
+    return -1;
+  if (iovcnt == 0) return 0;
 
-  last = bytes;
-  done_sz = 0;
+  size_t len = 0;
+  int i;
+  for (i = 0; i < iovcnt; i++) len += iov[i].iov_len;
 
-  /* use loop to write as much as possible in a task */
-  do {
-    left_sz = len - done_sz;
-    if (left_sz <= 0) return;
+  ionode_t *n = xmalloc(sizeof(ionode_t));
+  n->data = xmalloc(len);
+  n->p = n->data;
+  n->len = len;
+  n->fd = -1;
+  n->off = 0;
+  unsigned char *p = n->data;
+  for (i = 0; i < iovcnt; i++) {
+    memcpy(p, iov[i].iov_base, iov[i].iov_len);
+    p += iov[i].iov_len;
+  }
+  _ioq_append(q, n);
+  return 0;
+}
 
-    n = send(sockfd, last, left_sz, 0);
+/* len bytes of the file from off, copied in the kernel (sendfile),
+ * the queue owns fd and closes it once it is sent
+ *
+ * return - 0: sent or queued, -1: error */
+int ioqueue_sendfile(ioqueue_t *q,
+                     const int fd,
+                     off_t off,
+                     size_t len)
+{
+  ssize_t n;
+
+  while (q->head == NULL && len > 0) {
+    n = sendfile(q->sockfd, fd, &off, len);
     if (n == -1) {
-      /* perror("write()") */
-      if (errno == EPIPE) return;
-      nsleep(10);
-      continue;
+      if (errno == EINTR) continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+      close(fd);
+      return -1;
     }
+    /* the file got shorter */
+    if (n == 0) len = 0;
+    len -= n;
+  }
+  if (len == 0) {
+    close(fd);
+    return 0;
+  }
+
+  ionode_t *node = xmalloc(sizeof(ionode_t));
+  node->data = NULL;
+  node->p = NULL;
+  node->len = len;
+  node->fd = fd;
+  node->off = off;
+  _ioq_append(q, node);
+  return 0;
+}
 
-    last += n;
-    done_sz += n;
-  } while (1);
+/* resume the queued writes once the socket is writable again
+ *
+ * return - 1: queue drained, 0: socket full, -1: error */
+int ioqueue_flush(ioqueue_t *q)
+{
+  struct iovec iov[IOQ_MAXIOV];
+  ssize_t n;
+
+  while (q->head) {
+    ionode_t *node = q->head;
+    if (node->fd != -1) {
+      n = sendfile(q->sockfd, node->fd, &node->off, node->len);
+      /* the file got shorter */
+      if (n == 0) n = node->len;
+    }
+    else {
+      /* gather the buffered nodes up to the next file */
+      struct msghdr mh = {0};
+      int cnt = 0;
+      ionode_t *m;
+      for (m = node; m && m->fd == -1 && cnt < IOQ_MAXIOV; m = m->next) {
+        iov[cnt].iov_base = m->p;
+        iov[cnt].iov_len = m->len;
+        cnt++;
+      }
+      mh.msg_iov = iov;
+      mh.msg_iovlen = cnt;
+      n = sendmsg(q->sockfd, &mh, MSG_NOSIGNAL | (m ? MSG_MORE : 0));
+    }
+
+    if (n == -1) {
+      if (errno == EINTR) continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+      return -1;
+    }
+
+    /* drop what has been sent */
+    q->len -= n;
+    while (n > 0) {
+      node = q->head;
+      if ((size_t)n < node->len) {
+        if (node->p) node->p += n;
+        node->len -= n;
+        break;
+      }
+      n -= node->len;
+      _ioq_pop(q);
+    }
+  }
+  return 1;
 }
 
 unsigned char *io_fread(const char *fname,
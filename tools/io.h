@@ -5,12 +5,51 @@
 #define _IO_H_
 
 
-unsigned char *io_socket_read(const int sockfd,
-                              int *rc);
+#define IOQ_MAXIOV 16  /* nodes gathered in one sendmsg() */
 
-void io_socket_write(const int sockfd,
-                     const unsigned char *bytes,
-                     const size_t len);
+
+/* a pending write, bytes copied in data, or a file segment (sendfile) */
+typedef struct ionode_s {
+  struct ionode_s *next;
+  unsigned char *data;
+  unsigned char *p;  /* first byte not sent */
+  size_t len;        /* bytes not sent */
+  int fd;            /* -1 if not a file */
+  off_t off;
+} ionode_t;
+
+/* the outbound queue of a socket, filled when the socket is full and
+ * drained by ioqueue_flush() on EPOLLOUT */
+typedef struct {
+  int sockfd;
+  ionode_t *head;
+  ionode_t *tail;
+  size_t len;  /* bytes waiting */
+} ioqueue_t;
+
+
+int io_socket_read(const int sockfd,
+                   unsigned char **buf,
+                   size_t *size,
+                   size_t *len,
+                   const size_t want);
+
+void ioqueue_init(ioqueue_t *q,
+                  const int sockfd);
+
+void ioqueue_clear(ioqueue_t *q);
+
+int ioqueue_writev(ioqueue_t *q,
+                   struct iovec *iov,
+                   int iovcnt,
+                   const int flags);
+
+int ioqueue_sendfile(ioqueue_t *q,
+                     const int fd,
+                     off_t off,
+                     size_t len);
+
+int ioqueue_flush(ioqueue_t *q);
 
 unsigned char *io_fread(const char *fname,
                         const size_t len);
@@ -0,0 +1,89 @@
+/* license: MIT license
+ * Copyright (C) 2021  Edward LEI <edward_lei72@hotmail.com>
+ *
+ * Find delimiters (LF, ':', ' ', ...) 32 bytes (AVX2) or 16 bytes (SSE2)
+ * at a time, the scalar loop handles the tail and the non-x86 builds */
+
+#ifndef _SCAN_SIMD_H_
+#define _SCAN_SIMD_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+
+/* force inline for compilers */
+#ifndef INLINE
+#if (__GNUC__ > 3) || ((__GNUC__ == 3) && (__GNUC_MINOR__ >= 1))
+  #define INLINE __inline__ __attribute__((always_inline))
+#else
+  #define INLINE __inline__
+#endif
+#endif
+
+
+/* first c in [p, end), NULL if not found */
+static INLINE unsigned char *scan_chr(const unsigned char *p,
+                                      const unsigned char *end,
+                                      const unsigned char c)
+{
+#if defined(__AVX2__)
+  const __m256i vc32 = _mm256_set1_epi8(c);
+  while (end - p >= 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)p);
+    unsigned int m = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, vc32));
+    if (m) return (unsigned char *)p + __builtin_ctz(m);
+    p += 32;
+  }
+#endif
+#if defined(__SSE2__)
+  const __m128i vc16 = _mm_set1_epi8(c);
+  while (end - p >= 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)p);
+    unsigned int m = _mm_movemask_epi8(_mm_cmpeq_epi8(v, vc16));
+    if (m) return (unsigned char *)p + __builtin_ctz(m);
+    p += 16;
+  }
+#endif
+  for (; p < end; p++) {
+    if (*p == c) return (unsigned char *)p;
+  }
+  return NULL;
+}
+
+/* first c in the string s, or its terminating '\0' (like strchrnul)
+ *
+ * the loads are 16 bytes aligned, an aligned block never crosses a page,
+ * so reading past the '\0' inside the last block can't fault */
+static __inline__ __attribute__((no_sanitize_address))
+char *scan_chr_z(const char *s,
+                 const char c)
+{
+#if defined(__SSE2__)
+  const __m128i vc = _mm_set1_epi8(c);
+  const __m128i vz = _mm_setzero_si128();
+  uintptr_t off = (uintptr_t)s & 15;
+  const char *a = s - off;
+
+  __m128i v = _mm_load_si128((const __m128i *)a);
+  unsigned int m = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, vc),
+                                                  _mm_cmpeq_epi8(v, vz)));
+  /* drop the bytes before s */
+  m &= 0xffffu << off;
+  while (m == 0) {
+    a += 16;
+    v = _mm_load_si128((const __m128i *)a);
+    m = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, vc),
+                                       _mm_cmpeq_epi8(v, vz)));
+  }
+  return (char *)a + __builtin_ctz(m);
+#else
+  while (*s && *s != c) s++;
+  return (char *)s;
+#endif
+}
+
+
+#endif
@@ -1,8 +1,20 @@
-/* license: MIT license
+/* Work-stealing thread pool
+ *
+ * Every worker owns a Chase-Lev deque for the tasks it submits itself,
+ * the tasks from the other threads go through a lock-free injection queue.
+ * An idle worker pops its own deque, then the injection queue, then steals
+ * from the others, so a slow task never holds back the ones queued behind it
+ * while another worker is free.
+ *
+ * license: MIT license
  * Copyright (C) 2021  Edward LEI <edward_lei72@hotmail.com> */
 
+#define _GNU_SOURCE
 #include <stdio.h>
+#include <stdlib.h>
 #include <unistd.h>
+#include <sched.h>
+#include <time.h>
 #include <pthread.h>
 #include "xmalloc.h"
 #include "thpool.h"
@@ -11,288 +23,502 @@
 #include "debug.h"
 
 
-#define _offsetof(type, member) ((size_t)&(((type *)0)->member))
+/* the worker running on this thread, NULL outside the pools */
+static __thread thread_t *_self = NULL;
 
-#define container_of(ptr, type, member) ({                   \
-          const typeof(((type *)0)->member) *_mptr = (ptr);  \
-          (type *)((char *)_mptr - _offsetof(type, member)); \
-        })
 
-#define list_entry(list_ptr, type, member) \
-        container_of(list_ptr, type, member)
+static long _ustime()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+
+/* the slot fields are read racily by the stealers, a torn read is
+ * discarded when the CAS on top fails */
+static void _task_load(tp_task_t *dst, tp_task_t *src)
+{
+  dst->routine = __atomic_load_n(&src->routine, __ATOMIC_RELAXED);
+  dst->arg = __atomic_load_n(&src->arg, __ATOMIC_RELAXED);
+  dst->stamp = __atomic_load_n(&src->stamp, __ATOMIC_RELAXED);
+}
 
-#define list_first_entry(list_ptr, type, member) \
-        list_entry(list_ptr->next, type, member)
+static void _task_store(tp_task_t *dst, tp_task_t *src)
+{
+  __atomic_store_n(&dst->routine, src->routine, __ATOMIC_RELAXED);
+  __atomic_store_n(&dst->arg, src->arg, __ATOMIC_RELAXED);
+  __atomic_store_n(&dst->stamp, src->stamp, __ATOMIC_RELAXED);
+}
 
-#define list_next_entry(elem_ptr, member) \
-        list_entry((elem_ptr)->member.next, typeof(*(elem_ptr)), member)
+/* return - 1: pushed, 0: full */
+static int _deque_push(tp_deque_t *q, tp_task_t *t)
+{
+  long b = __atomic_load_n(&q->bottom, __ATOMIC_RELAXED);
+  long top = __atomic_load_n(&q->top, __ATOMIC_ACQUIRE);
+  if (b - top >= TP_DEQUE_SIZE) return 0;
+  _task_store(&q->tasks[b & (TP_DEQUE_SIZE - 1)], t);
+  __atomic_store_n(&q->bottom, b + 1, __ATOMIC_RELEASE);
+  return 1;
+}
 
-#define list_prev_entry(elem_ptr, member) \
-        list_entry((elem_ptr)->member.prev, typeof(*(elem_ptr)), member)
+/* owner only; return - 1: popped, 0: empty */
+static int _deque_pop(tp_deque_t *q, tp_task_t *t)
+{
+  long b = __atomic_load_n(&q->bottom, __ATOMIC_RELAXED) - 1;
+  __atomic_store_n(&q->bottom, b, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  long top = __atomic_load_n(&q->top, __ATOMIC_RELAXED);
+
+  if (top > b) {
+    /* empty */
+    __atomic_store_n(&q->bottom, b + 1, __ATOMIC_RELAXED);
+    return 0;
+  }
+  _task_load(t, &q->tasks[b & (TP_DEQUE_SIZE - 1)]);
+  if (top < b) return 1;
+
+  /* the last task, race against the stealers */
+  int won = __atomic_compare_exchange_n(&q->top, &top, top + 1, 0,
+                                        __ATOMIC_SEQ_CST, __ATOMIC_RELAXED);
+  __atomic_store_n(&q->bottom, b + 1, __ATOMIC_RELAXED);
+  return won;
+}
 
-#define list_foreach_entry(elem_ptr, head, member)                         \
-        for (elem_ptr = list_first_entry(head, typeof(*elem_ptr), member); \
-             &(elem_ptr->member) != (head);                                \
-             elem_ptr = list_next_entry(elem_ptr, member))
+/* any thread; return - 1: stolen, 0: empty or lost the race */
+static int _deque_steal(tp_deque_t *q, tp_task_t *t)
+{
+  long top = __atomic_load_n(&q->top, __ATOMIC_ACQUIRE);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  long b = __atomic_load_n(&q->bottom, __ATOMIC_ACQUIRE);
+  if (top >= b) return 0;
+
+  _task_load(t, &q->tasks[top & (TP_DEQUE_SIZE - 1)]);
+  return __atomic_compare_exchange_n(&q->top, &top, top + 1, 0,
+                                     __ATOMIC_SEQ_CST, __ATOMIC_RELAXED);
+}
 
+static void _inject_init(tp_inject_t *q)
+{
+  size_t i;
+  for (i = 0; i < TP_INJECT_SIZE; i++) q->cells[i].seq = i;
+  q->head = 0;
+  q->tail = 0;
+}
 
-static void list_set_head(tp_dlnode_t *list)
+/* return - 1: queued, 0: full */
+static int _inject_push(tp_inject_t *q, tp_task_t *t)
 {
-  list->next = list;
-  list->prev = list;
+  tp_cell_t *c;
+  size_t pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+  for (;;) {
+    c = &q->cells[pos & (TP_INJECT_SIZE - 1)];
+    size_t seq = __atomic_load_n(&c->seq, __ATOMIC_ACQUIRE);
+    long dif = (long)seq - (long)pos;
+    if (dif == 0) {
+      if (__atomic_compare_exchange_n(&q->tail, &pos, pos + 1, 1,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        break;
+    }
+    else if (dif < 0)
+      return 0;
+    else
+      pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+  }
+  c->task = *t;
+  __atomic_store_n(&c->seq, pos + 1, __ATOMIC_RELEASE);
+  return 1;
 }
 
-static void _list_add(tp_dlnode_t *node, tp_dlnode_t *prev, tp_dlnode_t *next)
+/* return - 1: dequeued, 0: empty */
+static int _inject_pop(tp_inject_t *q, tp_task_t *t)
 {
-  node->next = next;
-  node->prev = prev;
-  prev->next = node;
-  next->prev = node;
+  tp_cell_t *c;
+  size_t pos = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+  for (;;) {
+    c = &q->cells[pos & (TP_INJECT_SIZE - 1)];
+    size_t seq = __atomic_load_n(&c->seq, __ATOMIC_ACQUIRE);
+    long dif = (long)seq - (long)(pos + 1);
+    if (dif == 0) {
+      if (__atomic_compare_exchange_n(&q->head, &pos, pos + 1, 1,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        break;
+    }
+    else if (dif < 0)
+      return 0;
+    else
+      pos = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+  }
+  *t = c->task;
+  /* free for the producer of the next turn */
+  __atomic_store_n(&c->seq, pos + TP_INJECT_SIZE, __ATOMIC_RELEASE);
+  return 1;
 }
 
-static void list_add_tail(tp_dlnode_t *node, tp_dlnode_t *head)
+static int _next_task(thpool_t *tp,
+                      thread_t *curr,
+                      tp_task_t *t)
 {
-  _list_add(node, head->prev, head);
+  if (_deque_pop(&curr->deque, t)) return 1;
+  if (_inject_pop(&tp->inject, t)) return 1;
+
+  /* steal, starting from a random victim so the thieves spread out,
+   * a retired worker may still be robbed with a stale size */
+  int n = __atomic_load_n(&tp->size, __ATOMIC_ACQUIRE);
+  int start = rand_r(&curr->seed) % n;
+  int i;
+  for (i = 0; i < n; i++) {
+    thread_t *victim = tp->threads[(start + i) % n];
+    if (victim == curr) continue;
+    if (_deque_steal(&victim->deque, t)) return 1;
+  }
+  return 0;
 }
 
-static void _list_del(tp_dlnode_t *prev, tp_dlnode_t *next)
+/* wake a parked worker if there is any */
+static void _wake(thpool_t *tp)
 {
-  prev->next = next;
-  next->prev = prev;
+  __atomic_add_fetch(&tp->epoch, 1, __ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&tp->sleepers, __ATOMIC_SEQ_CST) == 0) return;
+  pthread_mutex_lock(&tp->mutex);
+  pthread_cond_signal(&tp->cond);
+  pthread_mutex_unlock(&tp->mutex);
 }
 
-static void list_del(tp_dlnode_t *entry)
+static void _run(thread_t *curr,
+                 tp_task_t *t)
 {
-  _list_del(entry->prev, entry->next);
+  /* only the owner writes, the master reads */
+  __atomic_store_n(&curr->waited, curr->waited + (_ustime() - t->stamp),
+                   __ATOMIC_RELAXED);
+  __atomic_store_n(&curr->state, THREAD_STATE_BUSY, __ATOMIC_RELAXED);
+  t->routine(t->arg);
+  __atomic_store_n(&curr->state, THREAD_STATE_IDLE, __ATOMIC_RELAXED);
+  __atomic_store_n(&curr->ran, curr->ran + 1, __ATOMIC_RELAXED);
 }
 
+/* a replaced worker quits even if the pool has grown back over its id */
+static int _retired(thpool_t *tp,
+                    thread_t *curr)
+{
+  return curr->id >= __atomic_load_n(&tp->size, __ATOMIC_ACQUIRE) ||
+         __atomic_load_n(&curr->retired, __ATOMIC_ACQUIRE);
+}
 
 static void *_worker_cb(void *arg)
 {
   thread_t *curr = (thread_t *)arg;
   thpool_t *tp = (thpool_t *)(curr->tp);
-  tp_task_t *t;
-
-  for (;;) {
-    pthread_mutex_lock(&curr->mutex);
-    while (curr->queue_size == 0 && curr->stop != THREAD_STOPPING) {
-      pthread_cond_wait(&curr->cond, &curr->mutex);
-    }
+  tp_task_t t;
 
-    if (curr->stop == THREAD_STOPPING) {
-      if (curr->queue_size == 0) {
-        pthread_mutex_unlock(&curr->mutex);
-        pthread_mutex_lock(&tp->global);
-        list_del(&curr->worker_entry);
-        list_del(&curr->idle_entry);
-        tp->size--;
-        pthread_mutex_unlock(&tp->global);
-        xfree(curr);
-        break;
-      }
-      else {
-        pthread_mutex_unlock(&curr->mutex);
-        continue;
-      }
-    }
-    else {
-      t = list_entry(curr->task_queue.next, tp_task_t, entry);
-      if (t) t->routine(t->arg);
-      list_del(&t->entry);
-      xfree(t);
-      curr->queue_size--;
+  _self = curr;
+  while (!_retired(tp, curr)) {
+    if (_next_task(tp, curr, &t)) {
+      _run(curr, &t);
+      continue;
     }
 
-    if (curr->queue_size == 0) {
-      pthread_mutex_lock(&tp->global);
-      list_add_tail(&(curr->idle_entry), &(tp->idle_queue));
-      pthread_mutex_unlock(&tp->global);
-      curr->state = THREAD_STATE_IDLE;
+    /* a submission after the epoch is read is seen by the check below,
+     * one before it changes the epoch the wait is on */
+    unsigned int epoch = __atomic_load_n(&tp->epoch, __ATOMIC_SEQ_CST);
+    if (_next_task(tp, curr, &t)) {
+      _run(curr, &t);
+      continue;
     }
-    pthread_mutex_unlock(&curr->mutex);
+    /* the queues are drained */
+    if (tp->stop) break;
+
+    pthread_mutex_lock(&tp->mutex);
+    __atomic_add_fetch(&tp->sleepers, 1, __ATOMIC_SEQ_CST);
+    while (__atomic_load_n(&tp->epoch, __ATOMIC_SEQ_CST) == epoch &&
+           !tp->stop && !_retired(tp, curr))
+      pthread_cond_wait(&tp->cond, &tp->mutex);
+    __atomic_sub_fetch(&tp->sleepers, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&tp->mutex);
   }
+
+  /* nobody steals from a retired worker anymore, run what it kept */
+  while (_deque_pop(&curr->deque, &t)) _run(curr, &t);
+  _self = NULL;
   return NULL;
 }
 
-static int _thread_add(thpool_t *tp, thread_t *t)
+static thread_t *_thread_new(thpool_t *tp, const int id)
 {
-  pthread_attr_t attr;
-  pthread_attr_init(&attr);
-  int ret = pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
-  if (ret != 0) {
-    pthread_attr_destroy(&attr);
-    return -1;
-  }
-
-  list_set_head(&t->task_queue);
-  pthread_mutex_lock(&tp->global);
-  list_add_tail(&(t->worker_entry), &(tp->worker_queue));
-  list_add_tail(&(t->idle_entry), &(tp->idle_queue));
-  tp->size++;
-  pthread_mutex_unlock(&tp->global);
+  thread_t *t = xmalloc(sizeof(thread_t));
+  t->deque.top = 0;
+  t->deque.bottom = 0;
+  t->id = id;
   t->state = THREAD_STATE_IDLE;
-  t->state = THREAD_RUNNING;
-  t->queue_size = 0;
+  t->joinable = 0;
+  t->retired = 0;
+  t->next = NULL;
+  t->seed = (unsigned int)id * 2654435761u;
+  t->ran = 0;
+  t->waited = 0;
   t->tp = (void *)tp;
-  pthread_mutex_init(&t->mutex, NULL);
-  pthread_cond_init(&t->cond, NULL);
-
-  pthread_create(&t->tid, &attr, _worker_cb, (void *)t);
-  pthread_attr_destroy(&attr);
-  return 0;
+  return t;
 }
 
-static void *_master_cb(void *arg)
+/* master only; the replaced workers which have quit are joined, never
+ * waited for */
+static void _reap(thpool_t *tp)
 {
-  thpool_t *tp = (thpool_t *)arg;
   thread_t *t;
+  for (t = tp->retired; t; t = t->next)
+    if (t->joinable && pthread_tryjoin_np(t->tid, NULL) == 0)
+      t->joinable = 0;
+}
 
-  sleep(tp->master_interval);
-  for (;;) {
-    int busy = 0;
-    int idle = 0;
-
-    pthread_mutex_lock(&tp->global);
-    list_foreach_entry(t, (&(tp->worker_queue)), worker_entry) {
-      if (t->state == THREAD_STATE_IDLE)
-        idle++;
-      else if (t->state == THREAD_STATE_BUSY)
-        busy++;
-    }
+/* master only; a replaced worker which has quit lends its struct, it is
+ * not freed before the pool as a stale stealer may still read it */
+static thread_t *_thread_take(thpool_t *tp, const int id)
+{
+  thread_t **p;
+  _reap(tp);
+  for (p = &tp->retired; *p; p = &(*p)->next) {
+    thread_t *t = *p;
+    if (t->joinable) continue;
+    *p = t->next;
+    t->id = id;
+    t->retired = 0;
+    t->next = NULL;
+    return t;
+  }
+  return _thread_new(tp, id);
+}
 
-    double threshold = busy / tp->size;
-    //D_PRINT("[POOL] threshold:%.2lf low_level:%.2lf\n",
-    //        threshold, p->low_level);
-    if (threshold < tp->low_level) {
-      tp_dlnode_t *next;
-      int delete_num = tp->size * (tp->low_level - threshold);
-      while (delete_num--) {
-        next = tp->idle_queue.next;
-        thread_t *t = list_entry(next, thread_t, idle_entry);
-        /* stop a thread */
-        pthread_mutex_lock(&t->mutex);
-        t->stop = THREAD_STOPPING;
-        pthread_cond_signal(&t->cond);
-        pthread_mutex_unlock(&t->mutex);
-        next = next->next;
-        D_PRINT("[POOL] stopping a thread...\n");
-      }
-    }
-    if (threshold > tp->high_level) {
-      int add_num = tp->size * (tp->high_level - threshold);
-      while (add_num--) {
-        thread_t *t = xmalloc(sizeof(thread_t));
-        if (t == NULL)
-          break;
-        else
-          _thread_add(tp, t);
-      }
+/* master only; return - 1: added, 0: failed */
+static int _grow(thpool_t *tp)
+{
+  int id = tp->size;
+  thread_t *t = tp->threads[id];
+
+  /* the slot is reused if its last worker has quit, the deque and the
+   * counters are kept; one still on its task keeps its struct, the
+   * deque has a single owner */
+  if (t == NULL)
+    t = tp->threads[id] = _thread_take(tp, id);
+  else if (t->joinable) {
+    if (pthread_tryjoin_np(t->tid, NULL) == 0)
+      t->joinable = 0;
+    else {
+      /* flagged before the size is published */
+      __atomic_store_n(&t->retired, 1, __ATOMIC_RELEASE);
+      t->next = tp->retired;
+      tp->retired = t;
+      t = tp->threads[id] = _thread_take(tp, id);
     }
+  }
+  /* published after the slot, the stealers see a complete worker,
+   * and before the start, the worker must not find itself retired */
+  __atomic_store_n(&tp->size, id + 1, __ATOMIC_RELEASE);
+  if (pthread_create(&t->tid, NULL, _worker_cb, (void *)t) != 0) {
+    perror("[POOL] pthread_create()");
+    __atomic_store_n(&tp->size, id, __ATOMIC_RELEASE);
+    return 0;
+  }
+  t->joinable = 1;
+  return 1;
+}
+
+/* master only; the last worker quits once it is done with its task */
+static void _shrink(thpool_t *tp)
+{
+  pthread_mutex_lock(&tp->mutex);
+  __atomic_store_n(&tp->size, tp->size - 1, __ATOMIC_RELEASE);
+  pthread_cond_broadcast(&tp->cond);
+  pthread_mutex_unlock(&tp->mutex);
+}
 
-    pthread_mutex_unlock(&tp->global);
-    D_PRINT("[POOL] busy:%d, idle:%d\n", busy, idle);
-    sleep(tp->master_interval);
+static int _depth(thpool_t *tp)
+{
+  long n = __atomic_load_n(&tp->inject.tail, __ATOMIC_RELAXED) -
+           __atomic_load_n(&tp->inject.head, __ATOMIC_RELAXED);
+  int i;
+  for (i = 0; i < tp->size; i++) {
+    tp_deque_t *q = &tp->threads[i]->deque;
+    n += __atomic_load_n(&q->bottom, __ATOMIC_RELAXED) -
+         __atomic_load_n(&q->top, __ATOMIC_RELAXED);
   }
-  return NULL;
+  return n < 0 ? 0 : n;
 }
 
-static int _pool_init(thpool_t *tp, double low_level, double high_level, int master_interval)
+static void _sample(thpool_t *tp)
 {
-  pthread_attr_t attr;
-  pthread_attr_init(&attr);
-  int ret = pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
-  if (ret != 0) {
-    pthread_attr_destroy(&attr);
-    return -1;
+  long ran = 0;
+  long waited = 0;
+  int i;
+  /* the retired workers keep their counts */
+  for (i = 0; i < tp->max_size && tp->threads[i]; i++) {
+    ran += __atomic_load_n(&tp->threads[i]->ran, __ATOMIC_RELAXED);
+    waited += __atomic_load_n(&tp->threads[i]->waited, __ATOMIC_RELAXED);
+  }
+  thread_t *t;
+  for (t = tp->retired; t; t = t->next) {
+    ran += __atomic_load_n(&t->ran, __ATOMIC_RELAXED);
+    waited += __atomic_load_n(&t->waited, __ATOMIC_RELAXED);
   }
 
-  pthread_mutex_init(&tp->global, NULL);
-  tp->max_size = THREAD_POOL_MAX_THREADS;
-  tp->min_size = THREAD_POOL_MIN_THREADS;
-  tp->low_level = low_level;
-  tp->high_level = high_level;
-  tp->master_interval = master_interval;
-  list_set_head(&tp->worker_queue);
-  list_set_head(&tp->idle_queue);
+  tp_sample_t *s = &tp->window[tp->nsamples % MASTER_WINDOW];
+  s->ran = ran - tp->ran;
+  s->waited = waited - tp->waited;
+  s->depth = _depth(tp);
+  s->busy = 0;
+  for (i = 0; i < tp->size; i++)
+    if (__atomic_load_n(&tp->threads[i]->state, __ATOMIC_RELAXED) ==
+        THREAD_STATE_BUSY) s->busy++;
+  tp->ran = ran;
+  tp->waited = waited;
+  tp->nsamples++;
+}
 
-  int size = tp->size;
+/* the pool is resized on what the last MASTER_WINDOW samples show, a burst
+ * grows it on a partial window, it only shrinks on a full one; the window
+ * starts over after a change */
+static void _adjust(thpool_t *tp)
+{
+  int n = tp->nsamples < MASTER_WINDOW ? tp->nsamples : MASTER_WINDOW;
+  if (n < 2) return;
+
+  long ran = 0;
+  long waited = 0;
+  int depth = 0;
+  int busy = 0;
   int i;
-  thread_t *t = NULL;
-  tp->size = 0;
-  for (i = 0; i < size; i++) {
-    t = xmalloc(sizeof(thread_t));
-    if (t == NULL) return -1;
-    if (_thread_add(tp, t) == -1) return -1;
+  for (i = 0; i < n; i++) {
+    /* the window is a ring */
+    tp_sample_t *s = &tp->window[(tp->nsamples - 1 - i) % MASTER_WINDOW];
+    ran += s->ran;
+    waited += s->waited;
+    depth += s->depth;
+    busy += s->busy;
   }
-  pthread_create(&tp->master_thread->tid, &attr, _master_cb, (void *)tp);
-  pthread_attr_destroy(&attr);
-  tp->task_next = list_first_entry((&tp->worker_queue), thread_t, worker_entry);
-  return 0;
+  long wait = ran ? waited / ran : 0;
+  double level = (double)busy / n / tp->size;
+  depth /= n;
+
+  int size = tp->size;
+  if (level > tp->high_level && (wait > TP_WAIT_HIGH || depth > size)) {
+    /* grow by a quarter */
+    int add = size / 4 + 1;
+    while (add-- && tp->size < tp->max_size && _grow(tp));
+  }
+  else if (n == MASTER_WINDOW && level < tp->low_level &&
+           wait < TP_WAIT_LOW && size > tp->min_size)
+    _shrink(tp);
+
+  if (tp->size != size) {
+    D_PRINT("[POOL] %d -> %d workers (busy:%.2lf, wait:%ldus, depth:%d)\n",
+            size, tp->size, level, wait, depth);
+    tp->nsamples = 0;
+  }
+}
+
+static void *_master_cb(void *arg)
+{
+  thpool_t *tp = (thpool_t *)arg;
+  struct timespec ts;
+
+  pthread_mutex_lock(&tp->mutex);
+  while (!tp->stop) {
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_nsec += MASTER_INTERVAL * 1000000L;
+    ts.tv_sec += ts.tv_nsec / 1000000000L;
+    ts.tv_nsec %= 1000000000L;
+    pthread_cond_timedwait(&tp->master_cond, &tp->mutex, &ts);
+    if (tp->stop) break;
+
+    /* resizing takes the lock (shrink) or starts a worker (grow) */
+    pthread_mutex_unlock(&tp->mutex);
+    _sample(tp);
+    _adjust(tp);
+    pthread_mutex_lock(&tp->mutex);
+  }
+  pthread_mutex_unlock(&tp->mutex);
+  return NULL;
 }
 
 thpool_t *thpool_new(int size)
 {
   thpool_t *tp = xmalloc(sizeof(thpool_t));
-  if (tp == NULL) return NULL;
-
-  thread_t *master_thread = xmalloc(sizeof(thread_t));
-  if (master_thread == NULL) {
-    xfree(tp);
-    return NULL;
-  }
-  tp->master_thread = master_thread;
-  tp->size = size;
+  _inject_init(&tp->inject);
+  tp->max_size = THREAD_POOL_MAX_THREADS;
+  tp->min_size = THREAD_POOL_MIN_THREADS;
+  tp->low_level = THREAD_IDLE_LEVEL;
+  tp->high_level = THREAD_BUSY_LEVEL;
+  tp->stop = 0;
+  tp->sleepers = 0;
+  tp->epoch = 0;
+  tp->nsamples = 0;
+  tp->ran = 0;
+  tp->waited = 0;
+  tp->retired = NULL;
+  pthread_mutex_init(&tp->mutex, NULL);
+  pthread_cond_init(&tp->cond, NULL);
+  pthread_cond_init(&tp->master_cond, NULL);
+
+  if (size < tp->min_size) size = tp->min_size;
+  if (size > tp->max_size) size = tp->max_size;
+  int i;
+  for (i = 0; i < tp->max_size; i++) tp->threads[i] = NULL;
+  tp->size = 0;
+  while (tp->size < size && _grow(tp));
 
-  _pool_init(tp, THREAD_IDLE_LEVEL, THREAD_BUSY_LEVEL, MASTER_INTERVAL);
+  if (pthread_create(&tp->master, NULL, _master_cb, (void *)tp) != 0)
+    perror("[POOL] pthread_create()");
+  D_PRINT("[POOL] %d workers running\n", tp->size);
   return tp;
 }
 
+/* the tasks already queued are run before the workers quit */
 void thpool_delete(thpool_t *tp)
 {
-  thread_t *th;
-  tp_task_t *t;
-  list_foreach_entry(th, (&(tp->worker_queue)), worker_entry) {
-    while (th->queue_size) {
-      t = list_entry(th->task_queue.next, tp_task_t, entry);
-      list_del(&t->entry);
-      xfree(t);
-      th->queue_size--;
-    }
-    xfree(th);
+  int i;
+  pthread_mutex_lock(&tp->mutex);
+  tp->stop = 1;
+  pthread_cond_broadcast(&tp->cond);
+  pthread_cond_signal(&tp->master_cond);
+  pthread_mutex_unlock(&tp->mutex);
+  pthread_join(tp->master, NULL);
+
+  /* the retired workers too; the others may steal until they quit */
+  for (i = 0; i < tp->max_size && tp->threads[i]; i++)
+    if (tp->threads[i]->joinable) pthread_join(tp->threads[i]->tid, NULL);
+  for (i = 0; i < tp->max_size && tp->threads[i]; i++)
+    xfree(tp->threads[i]);
+  while (tp->retired) {
+    thread_t *t = tp->retired;
+    tp->retired = t->next;
+    if (t->joinable) pthread_join(t->tid, NULL);
+    xfree(t);
   }
-  xfree(tp->master_thread);
+
+  pthread_mutex_destroy(&tp->mutex);
+  pthread_cond_destroy(&tp->cond);
+  pthread_cond_destroy(&tp->master_cond);
   xfree(tp);
 }
 
 void thpool_add_task(thpool_t *tp, void (*routine)(void *), void *arg)
 {
-  thread_t *th = NULL;
-  thread_t *last = NULL;
-
-  tp_task_t *t = xmalloc(sizeof(tp_task_t));
-  if (t == NULL) return;
-  t->routine = routine;
-  t->arg = arg;
-
-  pthread_mutex_lock(&tp->global);
-  th = tp->task_next;
-  last = list_entry(tp->worker_queue.prev, thread_t, worker_entry);
-  if (th == last)
-    tp->task_next = list_first_entry((&tp->worker_queue), thread_t, worker_entry);
-  else
-    tp->task_next = list_next_entry(th, worker_entry);
-  pthread_mutex_unlock(&tp->global);
-
-  pthread_mutex_lock(&th->mutex);
-  list_add_tail(&(t->entry), &(th->task_queue));
-  th->queue_size++;
-  if (th->queue_size == 1) {
-    th->state = THREAD_STATE_BUSY;
-    pthread_mutex_lock(&tp->global);
-    list_del(&(th->idle_entry));
-    pthread_mutex_unlock(&tp->global);
+  tp_task_t t;
+  t.routine = routine;
+  t.arg = arg;
+  t.stamp = _ustime();
+
+  /* a worker keeps its own tasks, hot in its cache, for the others
+   * to steal when they run dry */
+  if (_self && _self->tp == tp) {
+    if (!_deque_push(&_self->deque, &t) && !_inject_push(&tp->inject, &t)) {
+      /* everything is full, waiting here could block all the workers */
+      routine(arg);
+      return;
+    }
   }
-
-  pthread_cond_signal(&th->cond);
-  pthread_mutex_unlock(&th->mutex);
+  else {
+    /* the workers are behind, wait for a free cell */
+    while (!_inject_push(&tp->inject, &t)) sched_yield();
+  }
+  _wake(tp);
 }
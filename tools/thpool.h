@@ -11,51 +11,100 @@
 #define THREAD_STATE_BUSY 0x1
 #define THREAD_STATE_IDLE 0x2
 
-#define THREAD_STOPPING 0x1
-#define THREAD_RUNNING 0x2
-
+/* the master shrinks the pool under the idle level of busy workers,
+ * it grows it over the busy level when the tasks wait in the queues */
 #define THREAD_IDLE_LEVEL 0.2
 #define THREAD_BUSY_LEVEL 0.8
 
-#define MASTER_INTERVAL 30
+#define MASTER_INTERVAL 250 /* ms between two samples */
+#define MASTER_WINDOW 8     /* samples the decisions are made on */
+#define TP_WAIT_HIGH 1000   /* us queued on average, grow */
+#define TP_WAIT_LOW 100     /* us queued on average, may shrink */
 
+#define TP_DEQUE_SIZE 1024   /* tasks per worker, power of 2 */
+#define TP_INJECT_SIZE 16384 /* tasks from outside the pool, power of 2 */
+#define TP_CACHELINE 64
 
-typedef struct _tp_dlnode {
-  struct _tp_dlnode *next;
-  struct _tp_dlnode *prev;
-} tp_dlnode_t;
 
+/* a task is copied into the queues, nothing is allocated per task */
 typedef struct {
   void (*routine)(void *arg);
   void *arg;
-  tp_dlnode_t entry;
+  long stamp;               /* us, submitted */
 } tp_task_t;
 
+/* Chase-Lev deque, the owner pushes and pops at the bottom (LIFO),
+ * the other workers steal at the top (FIFO) */
+typedef struct {
+  volatile long top;
+  char pad0[TP_CACHELINE - sizeof(long)];
+  volatile long bottom;
+  char pad1[TP_CACHELINE - sizeof(long)];
+  tp_task_t tasks[TP_DEQUE_SIZE];
+} tp_deque_t;
+
+/* bounded MPMC ring (D. Vyukov), the sequence number of a cell tells
+ * whether it is free for the producer of a turn or ready for its consumer */
+typedef struct {
+  volatile size_t seq;
+  tp_task_t task;
+} tp_cell_t;
+
 typedef struct {
+  volatile size_t head;
+  char pad0[TP_CACHELINE - sizeof(size_t)];
+  volatile size_t tail;
+  char pad1[TP_CACHELINE - sizeof(size_t)];
+  tp_cell_t cells[TP_INJECT_SIZE];
+} tp_inject_t;
+
+typedef struct thread_s {
+  tp_deque_t deque;         /* tasks submitted by this thread */
   pthread_t tid;
-  pthread_mutex_t mutex;    /* mutex lock for task queue */
-  pthread_cond_t cond;
-  int state;                /* THREAD_STATE_BUSY or THREAD_STATE_IDLE */
-  int stop;                 /* mark if the thread is going to quit */
-  int queue_size;           /* the number of tasks in the task_queue */
-  tp_dlnode_t task_queue;   /* the head of task queue*/
-  tp_dlnode_t worker_entry; /* a node in the thread pool's worker queue */
-  tp_dlnode_t idle_entry;   /* a node in the thread pool's idle queue */
+  int id;
+  volatile int state;       /* THREAD_STATE_BUSY or THREAD_STATE_IDLE */
+  int joinable;             /* started, not joined yet */
+  volatile int retired;     /* replaced in its slot, quits */
+  struct thread_s *next;    /* the replaced workers */
+  unsigned int seed;        /* picks the first victim to steal from */
+  volatile long ran;        /* tasks run */
+  volatile long waited;     /* us the tasks were queued */
   void *tp;                 /* thread pool */
 } thread_t;
 
+/* what the master saw during one interval */
+typedef struct {
+  long ran;
+  long waited;
+  int depth;                /* queued tasks */
+  int busy;                 /* workers running a task */
+} tp_sample_t;
+
 typedef struct {
-  tp_dlnode_t worker_queue; /* the head of worker queue */
-  tp_dlnode_t idle_queue;   /* the head of idle queue */
-  thread_t *master_thread;  /* the struct of master thread */
-  pthread_mutex_t global;   /* the global lock for thread pool */
-  thread_t *task_next;
-  int size;                 /* the number of threads */
+  tp_inject_t inject;       /* tasks submitted from outside the pool */
+  thread_t *threads[THREAD_POOL_MAX_THREADS];
+  volatile int size;        /* the number of threads, only the master
+                             * changes it, the workers over it retire */
   int max_size;             /* maxium number of threads */
   int min_size;             /* minium numbers of threads */
-  double low_level;         /* the maxium proportion threshold of idle threads */
-  double high_level;        /* the minium proportion threshold of idle threads */
-  int master_interval;      /* the working interval of master thread */
+  double low_level;         /* busy proportion to shrink under */
+  double high_level;        /* busy proportion to grow over */
+  volatile int stop;        /* the workers drain the queues and quit */
+
+  /* adaptive sizing */
+  pthread_t master;
+  pthread_cond_t master_cond;
+  tp_sample_t window[MASTER_WINDOW];
+  int nsamples;
+  long ran;                 /* totals at the last sample */
+  long waited;
+  thread_t *retired;        /* replaced while still on a task */
+
+  /* parking of the idle workers */
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  volatile int sleepers;    /* workers waiting on cond */
+  volatile unsigned int epoch; /* bumped by every submission */
 } thpool_t;
 
 
@@ -8,6 +8,7 @@
 #include <errno.h>
 #include <time.h>
 #include <sys/stat.h>
+#include "scan_simd.h"
 #include "util.h"
 
 
@@ -56,27 +57,55 @@ int itos(unsigned char *outbuf,
   return j;
 }
 
+/* decimal, two digits a step, outbuf holds 21 bytes at least */
+int ltos(char *outbuf,
+         const long n)
+{
+  static const char pairs[] =
+    "00010203040506070809101112131415161718192021222324"
+    "25262728293031323334353637383940414243444546474849"
+    "50515253545556575859606162636465666768697071727374"
+    "75767778798081828384858687888990919293949596979899";
+  char tmp[20];
+  char *p = tmp + sizeof(tmp);
+  unsigned long u = n < 0 ? -(unsigned long)n : (unsigned long)n;
+  int len = 0;
+
+  while (u >= 100) {
+    const char *d = pairs + (u % 100) * 2;
+    u /= 100;
+    *--p = d[1];
+    *--p = d[0];
+  }
+  if (u >= 10) {
+    *--p = pairs[u * 2 + 1];
+    *--p = pairs[u * 2];
+  }
+  else {
+    *--p = '0' + u;
+  }
+
+  if (n < 0) outbuf[len++] = '-';
+  memcpy(outbuf + len, p, tmp + sizeof(tmp) - p);
+  len += tmp + sizeof(tmp) - p;
+  outbuf[len] = '\0';
+  return len;
+}
+
 char *split_kv(char *kv,
                const char delim)
 {
-  char *p = kv;
-  do {
-    if (*p == delim) {
-      /*  xxxxxxxxxxxx: xxxxxxxxxxxx\0
-       *  ^           ^              ^
-       *  h           p              p */
-      *p = '\0';
-      p++;
-      break;
-    }
+  /*  xxxxxxxxxxxx: xxxxxxxxxxxx\0
+   *  ^           ^              ^
+   *  h           p              p */
+  char *p = scan_chr_z(kv, delim);
+  if (*p) {
+    *p = '\0';
     p++;
-  } while (*p);
+  }
 
-  do {
-    /* assume that there is no 2nd ':' */
-    if (*p != ' ' && *p != '\t') break;
-    p++;
-  } while (*p);
+  /* assume that there is no 2nd ':' */
+  while (*p == ' ' || *p == '\t') p++;
 
   return p;  /* return the value */
 }
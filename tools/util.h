@@ -13,6 +13,9 @@ int itos(unsigned char *outbuf,
          const int base,
          const char sign);
 
+int ltos(char *outbuf,
+         const long n);
+
 char *split_kv(char *kv,
                const char delim);
 